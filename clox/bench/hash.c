@@ -0,0 +1,185 @@
+// Compares hashBytes with the FNV-1a hash it replaced: how fast each hashes
+// strings of various lengths, and how long the probe sequences in table.c
+// get with each on some realistic sets of keys.
+//
+// Build with "make hashbench".
+
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Must match table.c.
+#define GROUP_SIZE 16
+#define MAX_LOAD 0.875
+
+#define KEY_COUNT 100000
+#define KEY_MAX 96
+
+typedef uint32_t (*HashFn)(const char *chars, int length);
+
+static uint32_t hashFnv(const char *chars, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)chars[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static const struct {
+  const char *name;
+  HashFn hash;
+} hashes[] = {{"fnv-1a", hashFnv}, {"hashBytes", hashBytes}};
+
+#define HASH_COUNT (int)(sizeof(hashes) / sizeof(hashes[0]))
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void benchThroughput(void) {
+  static const int lengths[] = {4, 8, 16, 32, 64, 256, 1024, 16384};
+  static char buffer[16384 + 64];
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = (char)('a' + i * 7 % 26);
+  }
+
+  printf("throughput (MB/s)\n%8s", "length");
+  for (int h = 0; h < HASH_COUNT; h++) {
+    printf(" %12s", hashes[h].name);
+  }
+  printf("\n");
+
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    int length = lengths[l];
+    printf("%8d", length);
+
+    for (int h = 0; h < HASH_COUNT; h++) {
+      long iterations = 200000000L / length + 1000;
+      // Vary the start and feed the result back so nothing is hoisted.
+      uint32_t sink = 0;
+      double start = now();
+      for (long i = 0; i < iterations; i++) {
+        sink += hashes[h].hash(buffer + (sink & 63), length);
+      }
+      double seconds = now() - start;
+      printf(" %12.0f", (double)iterations * length / seconds / 1e6);
+      if (sink == 42) {
+        printf("!");
+      }
+    }
+    printf("\n");
+  }
+}
+
+static char keys[KEY_COUNT][KEY_MAX];
+static int keyLengths[KEY_COUNT];
+
+static void makeKeys(int set) {
+  static const char *words[] = {"get", "set", "value", "count", "user",
+                                "name", "index", "buffer", "node", "list"};
+  for (int i = 0; i < KEY_COUNT; i++) {
+    char *key = keys[i];
+    switch (set) {
+    case 0: // Identifiers.
+      keyLengths[i] = sprintf(key, "%s%s%d", words[i % 10],
+                              words[i / 10 % 10], i / 100);
+      break;
+    case 1: // Numbers, as a program printing a counter interns them.
+      keyLengths[i] = sprintf(key, "%d", i);
+      break;
+    case 2: // Paths that only differ near the end.
+      keyLengths[i] = sprintf(key, "/home/user/project/src/%s/%s_%d.lox",
+                              words[i % 10], words[i / 10 % 10], i / 100);
+      break;
+    }
+  }
+}
+
+static const char *keySetNames[] = {"identifiers", "numbers", "paths"};
+
+/**
+ * Add every key to a table at its maximum load with hash, the way table.c
+ * probes, and report how many groups each insertion looked at.
+ */
+static void probeLengths(HashFn hash, int count) {
+  int capacity = GROUP_SIZE;
+  while (count > capacity * MAX_LOAD) {
+    capacity *= 2;
+  }
+
+  // Plus a copy of the first group past the end, like the control bytes.
+  char *used = calloc(capacity + GROUP_SIZE, 1);
+  long totalGroups = 0;
+  int maxGroups = 0;
+  int atHome = 0;
+
+  for (int i = 0; i < count; i++) {
+    uint32_t keyHash = hash(keys[i], keyLengths[i]);
+    uint32_t slot = (keyHash >> 7) & (capacity - 1);
+    uint32_t step = 0;
+    int groups = 1;
+
+    while (true) {
+      int free = 0;
+      while (free < GROUP_SIZE && used[slot + free]) {
+        free++;
+      }
+      if (free < GROUP_SIZE) {
+        int index = (slot + free) & (capacity - 1);
+        used[index] = 1;
+        if (index < GROUP_SIZE) {
+          used[capacity + index] = 1;
+        }
+        atHome += free == 0;
+        break;
+      }
+
+      step += GROUP_SIZE;
+      slot = (slot + step) & (capacity - 1);
+      groups++;
+    }
+
+    totalGroups += groups;
+    if (groups > maxGroups) {
+      maxGroups = groups;
+    }
+  }
+
+  printf(" %6.3f %4d %6.1f%%", (double)totalGroups / count, maxGroups,
+         100.0 * atHome / count);
+  free(used);
+}
+
+static void benchProbes(void) {
+  static const int counts[] = {200, 7000, KEY_COUNT};
+
+  printf("\nprobe groups at maximum load (mean, max, keys in home slot)\n");
+  printf("%-12s %6s", "keys", "count");
+  for (int h = 0; h < HASH_COUNT; h++) {
+    printf(" %20s", hashes[h].name);
+  }
+  printf("\n");
+
+  for (int set = 0; set < 3; set++) {
+    makeKeys(set);
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+      printf("%-12s %6d", keySetNames[set], counts[c]);
+      for (int h = 0; h < HASH_COUNT; h++) {
+        probeLengths(hashes[h].hash, counts[c]);
+      }
+      printf("\n");
+    }
+  }
+}
+
+int main(void) {
+  benchThroughput();
+  benchProbes();
+  return 0;
+}
@@ -1,9 +1,13 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 #include <bits/stdint-uintn.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define CONSTANT_INDEX_MAX_LOAD 0.5
 
 /**
  * Initialize chunk as an empty list.
@@ -13,34 +17,233 @@ void initChunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   initValueArray(&chunk->constants);
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCapacity = 0;
+  chunk->arena = NULL;
+  chunk->packed = false;
+}
+
+static void *growArray(VM *vm, Chunk *chunk, void *pointer, size_t oldSize,
+                       size_t newSize) {
+  if (chunk->arena != NULL) {
+    return arenaGrow(vm, chunk->arena, pointer, oldSize, newSize);
+  }
+  return reallocate(vm, pointer, oldSize, newSize);
+}
+
+/**
+ * Start a new run of bytes on line at the end of the chunk.
+ */
+static void addLineRun(VM *vm, Chunk *chunk, int line) {
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = (LineRun *)growArray(vm, chunk, chunk->lines,
+                                        sizeof(LineRun) * oldCapacity,
+                                        sizeof(LineRun) * chunk->lineCapacity);
+  }
+
+  LineRun *run = &chunk->lines[chunk->lineCount++];
+  run->offset = chunk->count;
+  run->line = line;
 }
 
 /**
  * Append a byte to the end of a chunk.
  */
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+    chunk->code = (uint8_t *)growArray(vm, chunk, chunk->code, oldCapacity,
+                                       chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+  if (chunk->lineCount == 0 ||
+      chunk->lines[chunk->lineCount - 1].line != line) {
+    addLineRun(vm, chunk, line);
+  }
   chunk->count++;
 }
 
-int addConstant(Chunk *chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
-  return chunk->constants.count - 1;
+int getLine(Chunk *chunk, int offset) {
+  // Find the last run that starts at or before offset.
+  int low = 0;
+  int high = chunk->lineCount - 1;
+
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return chunk->lines[low].line;
+}
+
+static uint32_t hashConstant(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return AS_BOOL(value) ? 1 : 2;
+  case VAL_NIL:
+    return 3;
+  case VAL_INT:
+    return (uint32_t)AS_INT(value) * 2654435761u;
+  case VAL_NUMBER: {
+    uint64_t bits;
+    memcpy(&bits, &value.as.number, sizeof(bits));
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+  }
+  case VAL_SHORT_STRING: {
+    uint64_t bits = value.as.shortString;
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+  }
+  case VAL_OBJ:
+    if (IS_STRING(value)) {
+      return AS_STRING(value)->hash;
+    }
+    return (uint32_t)((uintptr_t)AS_OBJ(value) >> 3) * 2654435761u;
+  }
+
+  return 0;
+}
+
+/**
+ * Stricter than valuesEqual: 0 and -0 are different constants, and so are
+ * an int and a double.
+ */
+static bool constantsIdentical(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+
+  switch (a.type) {
+  case VAL_BOOL:
+    return AS_BOOL(a) == AS_BOOL(b);
+  case VAL_NIL:
+    return true;
+  case VAL_INT:
+    return AS_INT(a) == AS_INT(b);
+  case VAL_NUMBER:
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  case VAL_SHORT_STRING:
+    return a.as.shortString == b.as.shortString;
+  case VAL_OBJ:
+    // String constants are interned.
+    return AS_OBJ(a) == AS_OBJ(b);
+  }
+
+  return false;
+}
+
+/**
+ * Return the slot in the index where value is, or the empty slot where it
+ * would go.
+ */
+static int *findConstantSlot(Chunk *chunk, Value value) {
+  // Capacity is a power of two.
+  uint32_t mask = chunk->constantIndexCapacity - 1;
+  uint32_t index = hashConstant(value) & mask;
+
+  while (true) {
+    int *slot = chunk->constantIndex + index;
+    if (*slot == -1 ||
+        constantsIdentical(chunk->constants.values[*slot], value)) {
+      return slot;
+    }
+
+    index = (index + 1) & mask;
+  }
 }
 
-void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
+static void growConstantIndex(VM *vm, Chunk *chunk) {
+  // The old index is rebuilt from scratch, so don't copy it.
+  if (chunk->arena == NULL) {
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
+  }
+  chunk->constantIndexCapacity = GROW_CAPACITY(chunk->constantIndexCapacity);
+  chunk->constantIndex = (int *)growArray(
+      vm, chunk, NULL, 0, sizeof(int) * chunk->constantIndexCapacity);
+
+  for (int i = 0; i < chunk->constantIndexCapacity; i++) {
+    chunk->constantIndex[i] = -1;
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    *findConstantSlot(chunk, chunk->constants.values[i]) = i;
+  }
+}
+
+int addConstant(VM *vm, Chunk *chunk, Value value) {
+  if (chunk->constants.count + 1 >
+      chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD) {
+    growConstantIndex(vm, chunk);
+  }
+
+  int *slot = findConstantSlot(chunk, value);
+  if (*slot != -1) {
+    return *slot;
+  }
+
+  ValueArray *constants = &chunk->constants;
+  if (constants->capacity < constants->count + 1) {
+    int oldCapacity = constants->capacity;
+    constants->capacity = GROW_CAPACITY(oldCapacity);
+    constants->values = (Value *)growArray(
+        vm, chunk, constants->values, sizeof(Value) * oldCapacity,
+        sizeof(Value) * constants->capacity);
+  }
+
+  constants->values[constants->count] = value;
+  *slot = constants->count++;
+  return *slot;
+}
+
+static size_t packedSize(Chunk *chunk) {
+  return sizeof(Value) * chunk->constants.count +
+         sizeof(LineRun) * chunk->lineCount + chunk->count;
+}
+
+void packChunk(VM *vm, Chunk *chunk) {
+  // Values first and bytes last keeps everything aligned.
+  size_t constantsSize = sizeof(Value) * chunk->constants.count;
+  size_t linesSize = sizeof(LineRun) * chunk->lineCount;
+  uint8_t *block = (uint8_t *)reallocate(vm, NULL, 0, packedSize(chunk));
+
+  if (chunk->constants.count > 0) {
+    memcpy(block, chunk->constants.values, constantsSize);
+  }
+  memcpy(block + constantsSize, chunk->lines, linesSize);
+  memcpy(block + constantsSize + linesSize, chunk->code, chunk->count);
+
+  chunk->constants.values = (Value *)block;
+  chunk->constants.capacity = chunk->constants.count;
+  chunk->lines = (LineRun *)(block + constantsSize);
+  chunk->lineCapacity = chunk->lineCount;
+  chunk->code = block + constantsSize + linesSize;
+  chunk->capacity = chunk->count;
+  // Only needed while adding constants.
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCapacity = 0;
+  chunk->arena = NULL;
+  chunk->packed = true;
+}
+
+void freeChunk(VM *vm, Chunk *chunk) {
+  if (chunk->packed) {
+    reallocate(vm, chunk->constants.values, packedSize(chunk), 0);
+    initChunk(chunk);
+    return;
+  }
+
+  FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, LineRun, chunk->lines, chunk->lineCapacity);
+  freeValueArray(vm, &chunk->constants);
+  FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
   initChunk(chunk);
 }
\ No newline at end of file
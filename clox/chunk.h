@@ -12,6 +12,9 @@ typedef enum {
   OP_LOOP,
 
   OP_CONSTANT,
+  // Like OP_CONSTANT, but with a 24 bit operand for chunks with more than
+  // 256 constants. The other *_LONG instructions follow the same pattern.
+  OP_CONSTANT_LONG,
 
   OP_NIL,
   OP_TRUE,
@@ -19,8 +22,11 @@ typedef enum {
 
   OP_POP,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
 
@@ -35,24 +41,74 @@ typedef enum {
 
   OP_NOT,
   OP_NEGATE,
+
+  OP_CALL,
+
+  // Pops its operand's worth of elements and pushes a list of them.
+  OP_BUILD_LIST,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  // Pops its operand's worth of key and value pairs and pushes a map of them.
+  OP_BUILD_MAP,
+  // Like OP_GET_INDEX and OP_SET_INDEX with a string constant for the index.
+  // The operand is followed by two bytes caching where the key was in the
+  // last map it was looked up in.
+  OP_GET_KEY,
+  OP_SET_KEY,
 } OpCode;
 
+// What an OP_GET_KEY or OP_SET_KEY cache starts out as.
+#define KEY_CACHE_EMPTY 0xffff
+
+// The largest constant index a *_LONG instruction can address.
+#define CONSTANT_LONG_MAX 0xffffff
+
+struct Arena;
+
+// The line of every byte from offset up to where the next run starts.
+typedef struct {
+  int offset;
+  int line;
+} LineRun;
+
 typedef struct {
   uint8_t *code; // Dynamic array
-  int *lines;    // Each number is the line number for the corresponding byte
+  // A new run starts wherever the line changes, so this is short next to
+  // code.
+  LineRun *lines;
+  int lineCount;
+  int lineCapacity;
   ValueArray constants;
+  // Hash index over constants so that adding one that is already in the pool
+  // reuses its slot. Each slot holds an index into constants, or -1.
+  int *constantIndex;
+  int constantIndexCapacity;
   int count;    // Number of elements in array
   int capacity; // Number of elements that array can hold
+  // While set, the arrays above grow in this arena instead of the heap.
+  struct Arena *arena;
+  // Whether packChunk has moved the arrays into one block.
+  bool packed;
 } Chunk;
 
 void initChunk(Chunk *Chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+/**
+ * Return the line of the byte at offset.
+ */
+int getLine(Chunk *chunk, int offset);
 
 /**
- * Add a constant to the value array. Return the index where the constant was
- * appended.
+ * Add a constant to the value array, unless an identical one is already
+ * there. Return the index of the constant.
+ */
+int addConstant(VM *vm, Chunk *chunk, Value value);
+/**
+ * Move the code, lines and constants of a chunk growing in an arena into a
+ * single block of exactly the right size, so that the arena can be freed.
+ * Nothing can be written to the chunk after this.
  */
-int addConstant(Chunk *chunk, Value value);
-void freeChunk(Chunk *chunk);
+void packChunk(VM *vm, Chunk *chunk);
+void freeChunk(VM *vm, Chunk *chunk);
 
 #endif
\ No newline at end of file
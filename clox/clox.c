@@ -1,6 +1,9 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "intern.h"
+#include "kernels.h"
+#include "memory.h"
 #include "vm.h"
 
 #include <features.h>
@@ -54,37 +57,114 @@ static char *readFile(const char *path) {
   return buffer;
 }
 
-static void runFile(VM *vm, const char *path) {
+/**
+ * Parse a size in bytes, optionally followed by K, M or G. Return 0 if it
+ * isn't one.
+ */
+static size_t parseSize(const char *text) {
+  char *end;
+  unsigned long long size = strtoull(text, &end, 10);
+  if (end == text) {
+    return 0;
+  }
+
+  switch (*end) {
+  case 'G':
+    size *= 1024;
+    // Fallthrough.
+  case 'M':
+    size *= 1024;
+    // Fallthrough.
+  case 'K':
+    size *= 1024;
+    end++;
+    break;
+  }
+  return *end == '\0' ? (size_t)size : 0;
+}
+
+static int runFile(VM *vm, const char *path) {
   char *source = readFile(path);
   InterpretResult result = interpret(vm, source);
   free(source);
 
   switch (result) {
   case INTERPRET_COMPILE_ERROR:
-    exit(65);
+    return 65;
   case INTERPRET_RUNTIME_ERROR:
-    exit(70);
+    return 70;
   default:
-    exit(0);
+    return 0;
   }
 }
 
 int main(int argc, char *argv[]) {
+  bool gcPauses = false;
+  bool memStats = false;
+  bool sharedStrings = false;
+  int gcThreads = 1;
+  size_t heapLimit = 0;
+  int argi = 1;
+  for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+    if (strcmp(argv[argi], "--gc-pauses") == 0) {
+      gcPauses = true;
+    } else if (strcmp(argv[argi], "--mem-stats") == 0) {
+      memStats = true;
+    } else if (strcmp(argv[argi], "--shared-strings") == 0) {
+      sharedStrings = true;
+    } else if (strncmp(argv[argi], "--gc-threads=", 13) == 0) {
+      gcThreads = atoi(argv[argi] + 13);
+      if (gcThreads < 1 || gcThreads > GC_MAX_THREADS) {
+        fprintf(stderr, "--gc-threads must be between 1 and %d.\n",
+                GC_MAX_THREADS);
+        exit(64);
+      }
+    } else if (strncmp(argv[argi], "--float-kernels=", 16) == 0) {
+      if (!selectFloatKernels(argv[argi] + 16)) {
+        fprintf(stderr, "--float-kernels must be scalar, or sse2 or avx2 if "
+                        "the CPU has them.\n");
+        exit(64);
+      }
+    } else if (strncmp(argv[argi], "--heap-limit=", 13) == 0) {
+      heapLimit = parseSize(argv[argi] + 13);
+      if (heapLimit == 0) {
+        fprintf(stderr, "--heap-limit must be a size like 64M.\n");
+        exit(64);
+      }
+    } else {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[argi]);
+      exit(64);
+    }
+  }
+
   VM vm;
-  initVM(&vm);
+  initVM(&vm, sharedStrings);
+  vm.gcThreads = gcThreads;
+  vm.heapLimit = heapLimit;
+  int status = 0;
 
-  switch (argc) {
-  case 1:
+  switch (argc - argi) {
+  case 0:
     repl(&vm);
     break;
-  case 2:
-    runFile(&vm, argv[1]);
+  case 1:
+    status = runFile(&vm, argv[argi]);
     break;
   default:
-    fprintf(stderr, "Usage: clox | clox [path]\n");
+    fprintf(stderr, "Usage: clox [--float-kernels=NAME] [--gc-pauses] "
+                    "[--gc-threads=N] [--heap-limit=SIZE] [--mem-stats] "
+                    "[--shared-strings] [path]\n");
+    status = 64;
   }
 
+  if (gcPauses) {
+    printGCPauses(&vm);
+  }
+  if (memStats) {
+    printMemoryStats(&vm);
+  }
   freeVM(&vm);
+  freeSharedStrings();
 
-  return 0;
-}
\ No newline at end of file
+  return status;
+}
@@ -7,6 +7,9 @@
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+// Collect garbage on every allocation, to shake out missing roots.
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -7,6 +7,8 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "hash.h"
+#include "memory.h"
 #include "object.h"
 #include "value.h"
 
@@ -25,13 +27,16 @@ typedef enum {
   TYPE_SCRIPT,
 } FunctionType;
 
-typedef struct {
+typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
 
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
+
+  // Holds the function's chunk while it grows.
+  Arena arena;
 } Compiler;
 
 typedef struct {
@@ -52,7 +57,7 @@ typedef enum {
   PREC_TERM,       // + -
   PREC_FACTOR,     // * /
   PREC_UNARY,      // ! -
-  PREC_CALL,       // . ()
+  PREC_CALL,       // . () []
   PREC_PRIMARY
 } Precedence;
 
@@ -145,7 +150,7 @@ static bool match(Scanner *scanner, Parser *parser, TokenType type) {
 }
 
 static void emitByte(Parser *parser, Compiler *compiler, uint8_t byte) {
-  writeChunk(currentChunk(compiler), byte, parser->previous.line);
+  writeChunk(parser->vm, currentChunk(compiler), byte, parser->previous.line);
 }
 
 static void emitBytes(Parser *parser, Compiler *compiler, uint8_t byte1,
@@ -175,18 +180,39 @@ static void emitReturn(Parser *parser, Compiler *compiler) {
   emitByte(parser, compiler, OP_RETURN);
 }
 
-static uint8_t makeConstant(Parser *parser, Compiler *compiler, Value value) {
-  int constant = addConstant(currentChunk(compiler), value);
-  if (constant > UINT8_MAX) {
+static int makeConstant(Parser *parser, Compiler *compiler, Value value) {
+  // The value may be a string nothing else refers to yet.
+  push(parser->vm, value);
+  int constant = addConstant(parser->vm, currentChunk(compiler), value);
+  writeBarrier(parser->vm, (Obj *)compiler->function, value);
+  pop(parser->vm);
+  if (constant > CONSTANT_LONG_MAX) {
     error(parser, "Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+/**
+ * Emit an instruction that takes an index operand, using the long form with a
+ * 24 bit operand only when the index doesn't fit in a byte.
+ */
+static void emitIndexOp(Parser *parser, Compiler *compiler, uint8_t op,
+                        uint8_t longOp, int index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(parser, compiler, op, (uint8_t)index);
+    return;
+  }
+
+  emitByte(parser, compiler, longOp);
+  emitByte(parser, compiler, (index >> 16) & 0xff);
+  emitBytes(parser, compiler, (index >> 8) & 0xff, index & 0xff);
 }
+
 static void emitConstant(Parser *parser, Compiler *compiler, Value value) {
-  emitBytes(parser, compiler, OP_CONSTANT,
-            makeConstant(parser, compiler, value));
+  emitIndexOp(parser, compiler, OP_CONSTANT, OP_CONSTANT_LONG,
+              makeConstant(parser, compiler, value));
 }
 
 static void patchJump(Parser *parser, Compiler *compiler, int offset) {
@@ -210,17 +236,23 @@ static void initCompiler(Compiler *compiler, VM *vm, FunctionType type) {
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
   compiler->function = newFunction(vm);
+  initArena(&compiler->arena);
+  compiler->function->chunk.arena = &compiler->arena;
+  vm->compiler = compiler;
 
   // Stack slot 0 is reserved for the compiler and has an empty name.
   Local *local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->name.start = "";
   local->name.length = 0;
+  local->name.hash = hashBytes("", 0);
 }
 
 static ObjFunction *endCompiler(Parser *parser, Compiler *compiler) {
   emitReturn(parser, compiler);
   ObjFunction *function = compiler->function;
+  packChunk(parser->vm, &function->chunk);
+  freeArena(parser->vm, &compiler->arena);
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser->hadError) {
@@ -249,6 +281,8 @@ static void endScope(Parser *parser, Compiler *compiler) {
 // The table is further down
 ParseRule rules[];
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
+static void parseInfix(Scanner *scanner, Parser *parser, Compiler *compiler,
+                       Precedence precedence, bool canAssign);
 
 static void parsePrecedence(Scanner *scanner, Parser *parser,
                             Compiler *compiler, Precedence precedence) {
@@ -261,7 +295,14 @@ static void parsePrecedence(Scanner *scanner, Parser *parser,
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
   prefixRule(scanner, parser, compiler, canAssign);
+  parseInfix(scanner, parser, compiler, precedence, canAssign);
+}
 
+/**
+ * Parse the rest of an expression whose prefix has been parsed already.
+ */
+static void parseInfix(Scanner *scanner, Parser *parser, Compiler *compiler,
+                       Precedence precedence, bool canAssign) {
   while (precedence <= getRule(parser->current.type)->precedence) {
     advance(scanner, parser);
     ParseFn infixRule = getRule(parser->previous.type)->infix;
@@ -273,11 +314,11 @@ static void parsePrecedence(Scanner *scanner, Parser *parser,
   }
 }
 
-static uint8_t identifierConstant(Parser *parser, Compiler *compiler,
-                                  Token *name) {
-  return makeConstant(
-      parser, compiler,
-      OBJ_VAL(copyString(parser->vm, name->start, name->length)));
+static int identifierConstant(Parser *parser, Compiler *compiler,
+                              Token *name) {
+  return makeConstant(parser, compiler,
+                      OBJ_VAL(copyStringHashed(parser->vm, name->start,
+                                               name->length, name->hash)));
 }
 
 /**
@@ -295,7 +336,7 @@ static void addLocal(Parser *parser, Compiler *compiler, Token name) {
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
-  if (a->length != b->length) {
+  if (a->length != b->length || a->hash != b->hash) {
     return false;
   }
 
@@ -345,8 +386,8 @@ static void declareVariable(Parser *parser, Compiler *compiler) {
   addLocal(parser, compiler, *name);
 }
 
-static uint8_t parseVariable(Scanner *scanner, Parser *parser,
-                             Compiler *compiler, const char *errorMessage) {
+static int parseVariable(Scanner *scanner, Parser *parser, Compiler *compiler,
+                         const char *errorMessage) {
   consume(scanner, parser, TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable(parser, compiler);
@@ -361,13 +402,14 @@ static void markInitialized(Compiler *compiler) {
 }
 
 static void defineVariable(Parser *parser, Compiler *compiler,
-                           uint8_t global_idx) {
+                           int global_idx) {
   if (compiler->scopeDepth > 0) {
     markInitialized(compiler);
     return;
   }
 
-  emitBytes(parser, compiler, OP_DEFINE_GLOBAL, global_idx);
+  emitIndexOp(parser, compiler, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG,
+              global_idx);
 }
 
 static void and_(Scanner *scanner, Parser *parser, Compiler *compiler,
@@ -464,7 +506,7 @@ static void block(Scanner *scanner, Parser *parser, Compiler *compiler) {
 
 static void varDeclaration(Scanner *scanner, Parser *parser,
                            Compiler *compiler) {
-  uint8_t global_idx =
+  int global_idx =
       parseVariable(scanner, parser, compiler, "Expect variable name.");
 
   if (match(scanner, parser, TOKEN_EQUAL)) {
@@ -668,7 +710,13 @@ static void statement(Scanner *scanner, Parser *parser, Compiler *compiler) {
 static void number(Scanner *scanner, Parser *parser, Compiler *compiler,
                    bool canAssign) {
   double value = strtod(parser->previous.start, NULL);
-  emitConstant(parser, compiler, NUMBER_VAL(value));
+
+  // Literals are never negative, so there's no -0 to worry about here.
+  if (value <= INT32_MAX && value == (int32_t)value) {
+    emitConstant(parser, compiler, INT_VAL((int32_t)value));
+  } else {
+    emitConstant(parser, compiler, NUMBER_VAL(value));
+  }
 }
 
 static void or_(Scanner *scanner, Parser *parser, Compiler *compiler,
@@ -689,29 +737,32 @@ static void or_(Scanner *scanner, Parser *parser, Compiler *compiler,
 static void string(Scanner *scanner, Parser *parser, Compiler *compiler,
                    bool canAssign) {
   emitConstant(parser, compiler,
-               OBJ_VAL(copyString(parser->vm, parser->previous.start + 1,
-                                  parser->previous.length - 2)));
+               stringValue(parser->vm, parser->previous.start + 1,
+                           parser->previous.length - 2));
 }
 
 static void namedVariable(Scanner *scanner, Parser *parser, Compiler *compiler,
                           Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
   int arg = resolveLocal(parser, compiler, &name);
 
   if (arg != -1) {
-    getOp = OP_GET_LOCAL;
-    setOp = OP_SET_LOCAL;
+    // There can't be more than UINT8_COUNT locals.
+    getOp = getLongOp = OP_GET_LOCAL;
+    setOp = setLongOp = OP_SET_LOCAL;
   } else {
     arg = identifierConstant(parser, compiler, &name);
     getOp = OP_GET_GLOBAL;
+    getLongOp = OP_GET_GLOBAL_LONG;
     setOp = OP_SET_GLOBAL;
+    setLongOp = OP_SET_GLOBAL_LONG;
   }
 
   if (canAssign && match(scanner, parser, TOKEN_EQUAL)) {
     expression(scanner, parser, compiler);
-    emitBytes(parser, compiler, setOp, (uint8_t)arg);
+    emitIndexOp(parser, compiler, setOp, setLongOp, arg);
   } else {
-    emitBytes(parser, compiler, getOp, (uint8_t)arg);
+    emitIndexOp(parser, compiler, getOp, getLongOp, arg);
   }
 }
 
@@ -744,12 +795,121 @@ static void grouping(Scanner *scanner, Parser *parser, Compiler *compiler,
   consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+static uint8_t argumentList(Scanner *scanner, Parser *parser,
+                            Compiler *compiler) {
+  uint8_t argCount = 0;
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      expression(scanner, parser, compiler);
+      if (argCount == 255) {
+        error(parser, "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(Scanner *scanner, Parser *parser, Compiler *compiler,
+                 bool canAssign) {
+  (void)canAssign;
+  uint8_t argCount = argumentList(scanner, parser, compiler);
+  emitBytes(parser, compiler, OP_CALL, argCount);
+}
+
+static void list(Scanner *scanner, Parser *parser, Compiler *compiler,
+                 bool canAssign) {
+  (void)canAssign;
+  uint8_t count = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(scanner, parser, compiler);
+      if (count == 255) {
+        error(parser, "Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACKET,
+          "Expect ']' after list elements.");
+  emitBytes(parser, compiler, OP_BUILD_LIST, count);
+}
+
+static void map(Scanner *scanner, Parser *parser, Compiler *compiler,
+                bool canAssign) {
+  (void)canAssign;
+  uint8_t count = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      expression(scanner, parser, compiler);
+      consume(scanner, parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(scanner, parser, compiler);
+      if (count == 255) {
+        error(parser, "Can't have more than 255 entries in a map literal.");
+      }
+      count++;
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(parser, compiler, OP_BUILD_MAP, count);
+}
+
+static void emitKeyOp(Parser *parser, Compiler *compiler, uint8_t op,
+                      int key) {
+  emitBytes(parser, compiler, op, (uint8_t)key);
+  emitBytes(parser, compiler, KEY_CACHE_EMPTY >> 8, KEY_CACHE_EMPTY & 0xff);
+}
+
+static void subscript(Scanner *scanner, Parser *parser, Compiler *compiler,
+                      bool canAssign) {
+  // The constant of an index that is just a string literal, or -1.
+  int key = -1;
+  if (match(scanner, parser, TOKEN_STRING)) {
+    Token literal = parser->previous;
+    if (check(parser, TOKEN_RIGHT_BRACKET)) {
+      key = makeConstant(
+          parser, compiler,
+          stringValue(parser->vm, literal.start + 1, literal.length - 2));
+    } else {
+      // Only the start of a longer index expression.
+      string(scanner, parser, compiler, false);
+      parseInfix(scanner, parser, compiler, PREC_ASSIGNMENT, true);
+    }
+  } else {
+    expression(scanner, parser, compiler);
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  // Constant keys get an inline cache, if the constant fits in a byte.
+  bool cached = key != -1 && key <= UINT8_MAX;
+  if (key != -1 && !cached) {
+    emitIndexOp(parser, compiler, OP_CONSTANT, OP_CONSTANT_LONG, key);
+  }
+
+  if (canAssign && match(scanner, parser, TOKEN_EQUAL)) {
+    expression(scanner, parser, compiler);
+    if (cached) {
+      emitKeyOp(parser, compiler, OP_SET_KEY, key);
+    } else {
+      emitByte(parser, compiler, OP_SET_INDEX);
+    }
+  } else if (cached) {
+    emitKeyOp(parser, compiler, OP_GET_KEY, key);
+  } else {
+    emitByte(parser, compiler, OP_GET_INDEX);
+  }
+}
+
 // An array where the index of a token enum member is a parseRule
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -802,5 +962,12 @@ ObjFunction *compile(VM *vm, const char *source) {
   }
 
   ObjFunction *function = endCompiler(&parser, &compiler);
+  vm->compiler = NULL;
   return parser.hadError ? NULL : function;
 }
+
+void markCompilerRoots(VM *vm) {
+  if (vm->compiler != NULL) {
+    markObject(vm, (Obj *)vm->compiler->function);
+  }
+}
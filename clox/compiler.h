@@ -8,4 +8,5 @@
  * Return NULL on compile error.
  */
 ObjFunction *compile(VM *vm, const char *source);
+void markCompilerRoots(VM *vm);
 #endif
\ No newline at end of file
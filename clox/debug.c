@@ -44,12 +44,38 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  int constant_idx = (chunk->code[offset + 1] << 16) |
+                     (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant_idx);
+  printValue(chunk->constants.values[constant_idx]);
+  printf("'\n");
+  // 4 bytes: 1 for opcode, 3 for operand (index)
+  return offset + 4;
+}
+
+static int keyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant_idx = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant_idx);
+  printValue(chunk->constants.values[constant_idx]);
+  if (cache == KEY_CACHE_EMPTY) {
+    printf("'\n");
+  } else {
+    printf("' @%d\n", cache);
+  }
+  return offset + 4;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -69,6 +95,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_NEGATE", offset);
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_NIL:
     return simpleInstruction("OP_NIL", offset);
   case OP_TRUE:
@@ -79,10 +107,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_POP", offset);
   case OP_DEFINE_GLOBAL:
     return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
   case OP_GET_GLOBAL:
     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
   case OP_SET_GLOBAL:
     return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
@@ -103,6 +137,20 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_DIVIDE", offset);
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", chunk, offset);
+  case OP_BUILD_LIST:
+    return byteInstruction("OP_BUILD_LIST", chunk, offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_GET_INDEX", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_SET_INDEX", offset);
+  case OP_BUILD_MAP:
+    return byteInstruction("OP_BUILD_MAP", chunk, offset);
+  case OP_GET_KEY:
+    return keyInstruction("OP_GET_KEY", chunk, offset);
+  case OP_SET_KEY:
+    return keyInstruction("OP_SET_KEY", chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
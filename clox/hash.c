@@ -0,0 +1,89 @@
+#include "hash.h"
+
+#include <string.h>
+
+// A variant of wyhash (https://github.com/wangyi-fudan/wyhash). It reads
+// eight bytes at a time, and folds each pair of words into the state with
+// one 64x64->128 bit multiply, which mixes far better than FNV-1a's
+// multiply per byte.
+
+static const uint64_t SECRET[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                   0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+/**
+ * Multiply a by b and fold the 128 bit product into 64 bits.
+ */
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t *bytes) {
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return word;
+}
+
+static inline uint64_t read32(const uint8_t *bytes) {
+  uint32_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return word;
+}
+
+uint32_t hashBytes(const char *chars, int length) {
+  const uint8_t *bytes = (const uint8_t *)chars;
+  size_t remaining = (size_t)length;
+  uint64_t seed = mix(SECRET[0], SECRET[1]);
+  uint64_t a;
+  uint64_t b;
+
+  if (remaining <= 16) {
+    if (remaining >= 4) {
+      // Two overlapping reads from each end cover every byte.
+      size_t middle = (remaining >> 3) << 2;
+      a = read32(bytes) << 32 | read32(bytes + middle);
+      b = read32(bytes + remaining - 4) << 32 |
+          read32(bytes + remaining - 4 - middle);
+    } else if (remaining > 0) {
+      a = (uint64_t)bytes[0] << 16 | (uint64_t)bytes[remaining >> 1] << 8 |
+          bytes[remaining - 1];
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    if (remaining > 48) {
+      // Three independent lanes, so the multiplies can overlap.
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = mix(read64(bytes) ^ SECRET[1], read64(bytes + 8) ^ seed);
+        seed1 = mix(read64(bytes + 16) ^ SECRET[2], read64(bytes + 24) ^ seed1);
+        seed2 = mix(read64(bytes + 32) ^ SECRET[3], read64(bytes + 40) ^ seed2);
+        bytes += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (remaining > 16) {
+      seed = mix(read64(bytes) ^ SECRET[1], read64(bytes + 8) ^ seed);
+      bytes += 16;
+      remaining -= 16;
+    }
+
+    // The last 16 bytes, which may overlap ones already mixed in.
+    a = read64(bytes + remaining - 16);
+    b = read64(bytes + remaining - 8);
+  }
+
+  __uint128_t product = (__uint128_t)(a ^ SECRET[1]) * (b ^ seed);
+  uint64_t hash = mix((uint64_t)product ^ SECRET[0] ^ (uint64_t)length,
+                      (uint64_t)(product >> 64) ^ SECRET[1]);
+  return (uint32_t)hash;
+}
+
+uint32_t hashWord(uint64_t word) {
+  return (uint32_t)mix(word ^ SECRET[0], SECRET[1] ^ SECRET[2]);
+}
@@ -0,0 +1,16 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+/**
+ * Hash length bytes at chars. Strings and the identifiers the scanner finds
+ * are all hashed with this, so their hashes can be compared.
+ */
+uint32_t hashBytes(const char *chars, int length);
+/**
+ * Hash a single word, such as the bits of a number.
+ */
+uint32_t hashWord(uint64_t word);
+
+#endif
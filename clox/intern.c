@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+// Shared strings are kept in an open-addressed array of slots, probed
+// linearly. Finding a string takes no locks and adding one is a
+// compare-and-swap on an empty slot, so threads only wait for each other
+// while the array grows.
+#define SHARED_MIN_CAPACITY 1024
+
+// Left in a slot whose string has been copied to a bigger array, so that
+// nobody adds to it any more and readers know to look in the bigger one.
+#define MOVED ((ObjString *)1)
+
+typedef struct SharedTable {
+  int capacity;
+  // Strings added to this array, including ones that have since moved, plus
+  // slots reserved by threads that are about to add one.
+  int count;
+  // Set before any slot is moved.
+  struct SharedTable *next;
+  // The array this one replaced. Other threads may still be reading it, so
+  // it is only freed along with the strings.
+  struct SharedTable *older;
+  ObjString *slots[];
+} SharedTable;
+
+static SharedTable *current = NULL;
+// Held while an array is copied into a bigger one.
+static pthread_mutex_t growLock = PTHREAD_MUTEX_INITIALIZER;
+
+static SharedTable *newTable(int capacity) {
+  SharedTable *table =
+      calloc(1, sizeof(SharedTable) + sizeof(ObjString *) * capacity);
+  if (table == NULL) {
+    fprintf(stderr, "malloc failed.\n");
+    exit(1);
+  }
+  table->capacity = capacity;
+  return table;
+}
+
+static SharedTable *currentTable(void) {
+  SharedTable *table = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  if (table != NULL) {
+    return table;
+  }
+
+  SharedTable *first = newTable(SHARED_MIN_CAPACITY);
+  if (__atomic_compare_exchange_n(&current, &table, first, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return first;
+  }
+  // Another thread made one first.
+  free(first);
+  return table;
+}
+
+static ObjString *newSharedString(const char *chars, int length,
+                                  uint32_t hash) {
+  ObjString *string = malloc(sizeof(ObjString) + length + 1);
+  if (string == NULL) {
+    fprintf(stderr, "malloc failed.\n");
+    exit(1);
+  }
+
+  string->obj.header = ((uint64_t)OBJ_STRING << OBJ_TYPE_SHIFT) | OBJ_MARKED;
+  string->length = length;
+  string->hash = hash;
+  string->isInterned = true;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  return string;
+}
+
+static bool matches(ObjString *string, const char *chars, int length,
+                    uint32_t hash) {
+  return string->hash == hash && string->length == length &&
+         memcmp(string->chars, chars, length) == 0;
+}
+
+/**
+ * Look for the string without taking any locks. May miss one that is being
+ * copied into a bigger array, which adding it again then finds.
+ */
+static ObjString *findShared(SharedTable *table, const char *chars,
+                             int length, uint32_t hash) {
+  uint32_t mask = table->capacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    ObjString *string = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+    if (string == NULL) {
+      return NULL;
+    }
+    if (string == MOVED) {
+      return findShared(__atomic_load_n(&table->next, __ATOMIC_ACQUIRE), chars,
+                        length, hash);
+    }
+    if (matches(string, chars, length, hash)) {
+      return string;
+    }
+  }
+}
+
+/**
+ * Find the string or claim an empty slot for *copy, making the copy first if
+ * need be. Return NULL if the array is being grown. The caller must have
+ * reserved a slot in table->count, which this gives back unless it adds the
+ * copy.
+ */
+static ObjString *addShared(SharedTable *table, const char *chars, int length,
+                            uint32_t hash, ObjString **copy) {
+  ObjString *found = NULL;
+  uint32_t mask = table->capacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    ObjString *string = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+    if (string == NULL) {
+      if (*copy == NULL) {
+        *copy = newSharedString(chars, length, hash);
+      }
+      if (__atomic_compare_exchange_n(&table->slots[slot], &string, *copy,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE)) {
+        string = *copy;
+        *copy = NULL;
+        return string;
+      }
+      // Another thread took the slot, and string is now what it put there.
+    }
+
+    if (string == MOVED) {
+      break;
+    }
+    if (matches(string, chars, length, hash)) {
+      found = string;
+      break;
+    }
+  }
+
+  // Nothing was added, so the reserved slot is free again.
+  __atomic_sub_fetch(&table->count, 1, __ATOMIC_RELAXED);
+  return found;
+}
+
+static void grow(SharedTable *table) {
+  pthread_mutex_lock(&growLock);
+  if (__atomic_load_n(&current, __ATOMIC_ACQUIRE) != table) {
+    // Another thread grew it while we waited.
+    pthread_mutex_unlock(&growLock);
+    return;
+  }
+
+  SharedTable *bigger = newTable(table->capacity * 2);
+  __atomic_store_n(&table->next, bigger, __ATOMIC_RELEASE);
+
+  uint32_t mask = bigger->capacity - 1;
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString *string =
+        __atomic_exchange_n(&table->slots[i], MOVED, __ATOMIC_ACQ_REL);
+    if (string == NULL) {
+      continue;
+    }
+
+    uint32_t slot = string->hash & mask;
+    while (bigger->slots[slot] != NULL) {
+      slot = (slot + 1) & mask;
+    }
+    // Readers that found MOVED may already be looking here.
+    __atomic_store_n(&bigger->slots[slot], string, __ATOMIC_RELEASE);
+    bigger->count++;
+  }
+
+  bigger->older = table;
+  __atomic_store_n(&current, bigger, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&growLock);
+}
+
+ObjString *sharedString(const char *chars, int length, uint32_t hash) {
+  ObjString *string = findShared(currentTable(), chars, length, hash);
+  if (string != NULL) {
+    return string;
+  }
+
+  ObjString *copy = NULL;
+  while (true) {
+    SharedTable *table = currentTable();
+    // Keep the array at most half full, so probe sequences stay short and
+    // always end in an empty slot. Reserving the slot before looking for one
+    // keeps threads adding at the same time from overfilling it.
+    if (__atomic_fetch_add(&table->count, 1, __ATOMIC_RELAXED) >=
+        table->capacity / 2) {
+      __atomic_sub_fetch(&table->count, 1, __ATOMIC_RELAXED);
+      grow(table);
+      continue;
+    }
+
+    string = addShared(table, chars, length, hash, &copy);
+    if (string != NULL) {
+      break;
+    }
+
+    // Wait for the thread growing the array to finish.
+    pthread_mutex_lock(&growLock);
+    pthread_mutex_unlock(&growLock);
+  }
+
+  // Another thread added the same string while we were making the copy.
+  free(copy);
+  return string;
+}
+
+void freeSharedStrings(void) {
+  SharedTable *table = current;
+  if (table == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < table->capacity; i++) {
+    free(table->slots[i]);
+  }
+  while (table != NULL) {
+    SharedTable *older = table->older;
+    free(table);
+    table = older;
+  }
+  current = NULL;
+}
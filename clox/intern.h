@@ -0,0 +1,21 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * Return the process-wide interned string with these characters, adding one
+ * if there isn't one yet. Safe to call from any thread.
+ *
+ * Shared strings belong to no VM's heap. They are always marked, so no
+ * collector traces or frees them, and they live until freeSharedStrings().
+ */
+ObjString *sharedString(const char *chars, int length, uint32_t hash);
+
+/**
+ * Free every shared string. Only safe once no VM that used them is left.
+ */
+void freeSharedStrings(void);
+
+#endif
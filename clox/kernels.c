@@ -0,0 +1,448 @@
+#include <math.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static double sumScalar(const double *x, int count) {
+  double sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+static double dotScalar(const double *x, const double *y, int count) {
+  double sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+// The first NaN wins, and -0 counts as less than 0, so that every kernel set
+// gives the same answer whatever order it visits the elements in.
+static double minOf(double min, double x) {
+  if (x < min) {
+    return x;
+  }
+  if (x > min || isnan(min)) {
+    return min;
+  }
+  // Equal, or x is NaN.
+  return isnan(x) || signbit(x) ? x : min;
+}
+
+static double maxOf(double max, double x) {
+  if (x > max) {
+    return x;
+  }
+  if (x < max || isnan(max)) {
+    return max;
+  }
+  return isnan(x) || !signbit(x) ? x : max;
+}
+
+static double minScalar(const double *x, int count) {
+  double min = x[0];
+  for (int i = 1; i < count; i++) {
+    min = minOf(min, x[i]);
+  }
+  return min;
+}
+
+static double maxScalar(const double *x, int count) {
+  double max = x[0];
+  for (int i = 1; i < count; i++) {
+    max = maxOf(max, x[i]);
+  }
+  return max;
+}
+
+static void scaleScalar(double *x, double a, int count) {
+  for (int i = 0; i < count; i++) {
+    x[i] *= a;
+  }
+}
+
+static void axpyScalar(double a, const double *x, double *y, int count) {
+  for (int i = 0; i < count; i++) {
+    y[i] += a * x[i];
+  }
+}
+
+static void addScalar(const double *x, const double *y, double *out,
+                      int count) {
+  for (int i = 0; i < count; i++) {
+    out[i] = x[i] + y[i];
+  }
+}
+
+static void mulScalar(const double *x, const double *y, double *out,
+                      int count) {
+  for (int i = 0; i < count; i++) {
+    out[i] = x[i] * y[i];
+  }
+}
+
+static const FloatKernels scalarKernels = {
+    "scalar",  sumScalar,   dotScalar, minScalar, maxScalar,
+    scaleScalar, axpyScalar, addScalar, mulScalar,
+};
+
+#ifdef __x86_64__
+
+// Every x86-64 CPU has SSE2, which works on two doubles at a time. The loops
+// keep two accumulators so that consecutive adds don't wait on each other,
+// and finish the last few elements with the scalar kernels.
+
+static double sumSse2(const double *x, int count) {
+  __m128d sum0 = _mm_setzero_pd();
+  __m128d sum1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sum0 = _mm_add_pd(sum0, _mm_loadu_pd(x + i));
+    sum1 = _mm_add_pd(sum1, _mm_loadu_pd(x + i + 2));
+  }
+  sum0 = _mm_add_pd(sum0, sum1);
+  sum0 = _mm_add_sd(sum0, _mm_unpackhi_pd(sum0, sum0));
+  return _mm_cvtsd_f64(sum0) + sumScalar(x + i, count - i);
+}
+
+static double dotSse2(const double *x, const double *y, int count) {
+  __m128d sum0 = _mm_setzero_pd();
+  __m128d sum1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sum0 = _mm_add_pd(sum0,
+                      _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(x + i + 2),
+                                       _mm_loadu_pd(y + i + 2)));
+  }
+  sum0 = _mm_add_pd(sum0, sum1);
+  sum0 = _mm_add_sd(sum0, _mm_unpackhi_pd(sum0, sum0));
+  return _mm_cvtsd_f64(sum0) + dotScalar(x + i, y + i, count - i);
+}
+
+// The min and max instructions drop a NaN in their first operand, so the
+// vector kernels note any NaN on the side and leave those arrays to the
+// scalar kernels, which return the first one. On a tie they return the second
+// operand, so they are run both ways round and the results combined to pick
+// -0 over 0 like minOf() and maxOf().
+
+// All ones in the lanes of a that hold NaN.
+static __m128d nanPair(__m128d a) {
+  return _mm_cmpunord_pd(a, a);
+}
+
+static __m128d minPair(__m128d a, __m128d b) {
+  return _mm_or_pd(_mm_min_pd(a, b), _mm_min_pd(b, a));
+}
+
+static __m128d maxPair(__m128d a, __m128d b) {
+  return _mm_and_pd(_mm_max_pd(a, b), _mm_max_pd(b, a));
+}
+
+static double minSse2(const double *x, int count) {
+  if (count < 4) {
+    return minScalar(x, count);
+  }
+  __m128d min0 = _mm_loadu_pd(x);
+  __m128d min1 = _mm_loadu_pd(x + 2);
+  __m128d nan = _mm_or_pd(nanPair(min0), nanPair(min1));
+  int i = 4;
+  for (; i + 4 <= count; i += 4) {
+    __m128d next0 = _mm_loadu_pd(x + i);
+    __m128d next1 = _mm_loadu_pd(x + i + 2);
+    min0 = minPair(min0, next0);
+    min1 = minPair(min1, next1);
+    nan = _mm_or_pd(nan, _mm_or_pd(nanPair(next0), nanPair(next1)));
+  }
+  if (_mm_movemask_pd(nan) != 0) {
+    return minScalar(x, count);
+  }
+
+  min0 = minPair(min0, min1);
+  min0 = minPair(min0, _mm_unpackhi_pd(min0, min0));
+  double result = _mm_cvtsd_f64(min0);
+  for (; i < count; i++) {
+    result = minOf(result, x[i]);
+  }
+  return result;
+}
+
+static double maxSse2(const double *x, int count) {
+  if (count < 4) {
+    return maxScalar(x, count);
+  }
+  __m128d max0 = _mm_loadu_pd(x);
+  __m128d max1 = _mm_loadu_pd(x + 2);
+  __m128d nan = _mm_or_pd(nanPair(max0), nanPair(max1));
+  int i = 4;
+  for (; i + 4 <= count; i += 4) {
+    __m128d next0 = _mm_loadu_pd(x + i);
+    __m128d next1 = _mm_loadu_pd(x + i + 2);
+    max0 = maxPair(max0, next0);
+    max1 = maxPair(max1, next1);
+    nan = _mm_or_pd(nan, _mm_or_pd(nanPair(next0), nanPair(next1)));
+  }
+  if (_mm_movemask_pd(nan) != 0) {
+    return maxScalar(x, count);
+  }
+
+  max0 = maxPair(max0, max1);
+  max0 = maxPair(max0, _mm_unpackhi_pd(max0, max0));
+  double result = _mm_cvtsd_f64(max0);
+  for (; i < count; i++) {
+    result = maxOf(result, x[i]);
+  }
+  return result;
+}
+
+static void scaleSse2(double *x, double a, int count) {
+  __m128d scale = _mm_set1_pd(a);
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), scale));
+  }
+  scaleScalar(x + i, a, count - i);
+}
+
+static void axpySse2(double a, const double *x, double *y, int count) {
+  __m128d scale = _mm_set1_pd(a);
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d product = _mm_mul_pd(_mm_loadu_pd(x + i), scale);
+    _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+  }
+  axpyScalar(a, x + i, y + i, count - i);
+}
+
+static void addSse2(const double *x, const double *y, double *out,
+                    int count) {
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+  }
+  addScalar(x + i, y + i, out + i, count - i);
+}
+
+static void mulSse2(const double *x, const double *y, double *out,
+                    int count) {
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+  }
+  mulScalar(x + i, y + i, out + i, count - i);
+}
+
+static const FloatKernels sse2Kernels = {
+    "sse2",    sumSse2,  dotSse2, minSse2, maxSse2,
+    scaleSse2, axpySse2, addSse2, mulSse2,
+};
+
+// AVX2 with FMA works on four doubles at a time, and fuses the multiply and
+// add in dot and axpy. These are compiled for those instructions even though
+// the rest of clox isn't, and only run once the CPU says it has them.
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static double horizontalSum(__m256d sum) {
+  __m128d half =
+      _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  half = _mm_add_sd(half, _mm_unpackhi_pd(half, half));
+  return _mm_cvtsd_f64(half);
+}
+
+AVX2 static double sumAvx2(const double *x, int count) {
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(x + i));
+    sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(x + i + 4));
+  }
+  return horizontalSum(_mm256_add_pd(sum0, sum1)) +
+         sumScalar(x + i, count - i);
+}
+
+AVX2 static double dotAvx2(const double *x, const double *y, int count) {
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    sum0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i),
+                           sum0);
+    sum1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4),
+                           _mm256_loadu_pd(y + i + 4), sum1);
+  }
+  return horizontalSum(_mm256_add_pd(sum0, sum1)) +
+         dotScalar(x + i, y + i, count - i);
+}
+
+AVX2 static __m256d nanQuad(__m256d a) {
+  return _mm256_cmp_pd(a, a, _CMP_UNORD_Q);
+}
+
+AVX2 static __m256d minQuad(__m256d a, __m256d b) {
+  return _mm256_or_pd(_mm256_min_pd(a, b), _mm256_min_pd(b, a));
+}
+
+AVX2 static __m256d maxQuad(__m256d a, __m256d b) {
+  return _mm256_and_pd(_mm256_max_pd(a, b), _mm256_max_pd(b, a));
+}
+
+AVX2 static double minAvx2(const double *x, int count) {
+  if (count < 8) {
+    return minScalar(x, count);
+  }
+  __m256d min0 = _mm256_loadu_pd(x);
+  __m256d min1 = _mm256_loadu_pd(x + 4);
+  __m256d nan = _mm256_or_pd(nanQuad(min0), nanQuad(min1));
+  int i = 8;
+  for (; i + 8 <= count; i += 8) {
+    __m256d next0 = _mm256_loadu_pd(x + i);
+    __m256d next1 = _mm256_loadu_pd(x + i + 4);
+    min0 = minQuad(min0, next0);
+    min1 = minQuad(min1, next1);
+    nan = _mm256_or_pd(nan, _mm256_or_pd(nanQuad(next0), nanQuad(next1)));
+  }
+  if (_mm256_movemask_pd(nan) != 0) {
+    return minScalar(x, count);
+  }
+
+  min0 = minQuad(min0, min1);
+  __m128d half = minPair(_mm256_castpd256_pd128(min0),
+                         _mm256_extractf128_pd(min0, 1));
+  half = minPair(half, _mm_unpackhi_pd(half, half));
+  double result = _mm_cvtsd_f64(half);
+  for (; i < count; i++) {
+    result = minOf(result, x[i]);
+  }
+  return result;
+}
+
+AVX2 static double maxAvx2(const double *x, int count) {
+  if (count < 8) {
+    return maxScalar(x, count);
+  }
+  __m256d max0 = _mm256_loadu_pd(x);
+  __m256d max1 = _mm256_loadu_pd(x + 4);
+  __m256d nan = _mm256_or_pd(nanQuad(max0), nanQuad(max1));
+  int i = 8;
+  for (; i + 8 <= count; i += 8) {
+    __m256d next0 = _mm256_loadu_pd(x + i);
+    __m256d next1 = _mm256_loadu_pd(x + i + 4);
+    max0 = maxQuad(max0, next0);
+    max1 = maxQuad(max1, next1);
+    nan = _mm256_or_pd(nan, _mm256_or_pd(nanQuad(next0), nanQuad(next1)));
+  }
+  if (_mm256_movemask_pd(nan) != 0) {
+    return maxScalar(x, count);
+  }
+
+  max0 = maxQuad(max0, max1);
+  __m128d half = maxPair(_mm256_castpd256_pd128(max0),
+                         _mm256_extractf128_pd(max0, 1));
+  half = maxPair(half, _mm_unpackhi_pd(half, half));
+  double result = _mm_cvtsd_f64(half);
+  for (; i < count; i++) {
+    result = maxOf(result, x[i]);
+  }
+  return result;
+}
+
+AVX2 static void scaleAvx2(double *x, double a, int count) {
+  __m256d scale = _mm256_set1_pd(a);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), scale));
+  }
+  scaleScalar(x + i, a, count - i);
+}
+
+AVX2 static void axpyAvx2(double a, const double *x, double *y, int count) {
+  __m256d scale = _mm256_set1_pd(a);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(_mm256_loadu_pd(x + i), scale,
+                                            _mm256_loadu_pd(y + i)));
+  }
+  axpyScalar(a, x + i, y + i, count - i);
+}
+
+AVX2 static void addAvx2(const double *x, const double *y, double *out,
+                         int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  }
+  addScalar(x + i, y + i, out + i, count - i);
+}
+
+AVX2 static void mulAvx2(const double *x, const double *y, double *out,
+                         int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  }
+  mulScalar(x + i, y + i, out + i, count - i);
+}
+
+#undef AVX2
+
+static const FloatKernels avx2Kernels = {
+    "avx2",    sumAvx2,  dotAvx2, minAvx2, maxAvx2,
+    scaleAvx2, axpyAvx2, addAvx2, mulAvx2,
+};
+
+static bool hasAvx2(void) {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+#endif
+
+// Set once, to the same thing by whichever thread gets there first.
+static const FloatKernels *selected = NULL;
+
+const FloatKernels *floatKernels(void) {
+  const FloatKernels *kernels = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+  if (kernels != NULL) {
+    return kernels;
+  }
+
+#ifdef __x86_64__
+  kernels = hasAvx2() ? &avx2Kernels : &sse2Kernels;
+#else
+  kernels = &scalarKernels;
+#endif
+  __atomic_store_n(&selected, kernels, __ATOMIC_RELAXED);
+  return kernels;
+}
+
+bool selectFloatKernels(const char *name) {
+  const FloatKernels *kernels = NULL;
+  if (strcmp(name, "scalar") == 0) {
+    kernels = &scalarKernels;
+  }
+#ifdef __x86_64__
+  if (strcmp(name, "sse2") == 0) {
+    kernels = &sse2Kernels;
+  }
+  if (strcmp(name, "avx2") == 0 && hasAvx2()) {
+    kernels = &avx2Kernels;
+  }
+#endif
+
+  if (kernels == NULL) {
+    return false;
+  }
+  __atomic_store_n(&selected, kernels, __ATOMIC_RELAXED);
+  return true;
+}
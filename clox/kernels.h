@@ -0,0 +1,35 @@
+#ifndef clox_kernels_h
+#define clox_kernels_h
+
+#include "common.h"
+
+// Loops over arrays of doubles, for the float array natives. There is a set
+// for each instruction set, chosen when first used from what the CPU
+// supports. Sets add up elements in different orders, and the AVX2 set fuses
+// the multiply and add in dot and axpy, so those results may differ in their
+// last bits between CPUs. The others give the same results everywhere.
+typedef struct {
+  const char *name;
+  double (*sum)(const double *x, int count);
+  double (*dot)(const double *x, const double *y, int count);
+  // Of at least one element. If x has NaNs, the first of them. -0 counts as
+  // less than 0.
+  double (*min)(const double *x, int count);
+  double (*max)(const double *x, int count);
+  // x *= a
+  void (*scale)(double *x, double a, int count);
+  // y += a * x
+  void (*axpy)(double a, const double *x, double *y, int count);
+  // out = x + y and out = x * y
+  void (*add)(const double *x, const double *y, double *out, int count);
+  void (*mul)(const double *x, const double *y, double *out, int count);
+} FloatKernels;
+
+const FloatKernels *floatKernels(void);
+/**
+ * Use the kernels called name instead of the best ones for this CPU. Returns
+ * false if there are none by that name, or the CPU can't run them.
+ */
+bool selectFloatKernels(const char *name);
+
+#endif
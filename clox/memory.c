@@ -1,51 +1,1165 @@
 #include "memory.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "object.h"
+#include "table.h"
 #include "value.h"
 #include "vm.h"
 
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
-
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+static bool isPooled(size_t size) {
+  return size > 0 && size <= POOL_MAX_SIZE;
+}
+
+static int sizeClass(size_t size) {
+  return (int)((size - 1) / POOL_GRANULE);
+}
+
+static void *poolAllocate(VM *vm, size_t size) {
+  int class = sizeClass(size);
+
+  if (vm->poolFree[class] == NULL) {
+    // Carve a new slab into blocks of this class, after the link to the
+    // next slab.
+    uint8_t *slab = (uint8_t *)malloc(POOL_SLAB_SIZE);
+    if (slab == NULL) {
+      return NULL;
+    }
+    *(void **)slab = vm->poolSlabs;
+    vm->poolSlabs = slab;
+
+    size_t blockSize = (size_t)(class + 1) * POOL_GRANULE;
+    for (uint8_t *block = slab + POOL_GRANULE;
+         block + blockSize <= slab + POOL_SLAB_SIZE; block += blockSize) {
+      *(void **)block = vm->poolFree[class];
+      vm->poolFree[class] = block;
+    }
+  }
+
+  void *block = vm->poolFree[class];
+  vm->poolFree[class] = *(void **)block;
+  return block;
+}
+
+static void poolRelease(VM *vm, void *block, size_t size) {
+  int class = sizeClass(size);
+  *(void **)block = vm->poolFree[class];
+  vm->poolFree[class] = block;
+}
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;
+} ArenaBlock;
+
+void initArena(Arena *arena) {
+  arena->blocks = NULL;
+  arena->top = NULL;
+  arena->end = NULL;
+  arena->last = NULL;
+}
+
+void *arenaGrow(VM *vm, Arena *arena, void *ptr, size_t oldSize,
+                size_t newSize) {
+  size_t size = (newSize + 7) & ~(size_t)7;
+
+  if (ptr != NULL && ptr == arena->last &&
+      size <= (size_t)(arena->end - (uint8_t *)ptr)) {
+    arena->top = (uint8_t *)ptr + size;
+    return ptr;
+  }
+
+  if (size > (size_t)(arena->end - arena->top)) {
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock *block = (ArenaBlock *)reallocate(
+        vm, NULL, 0, sizeof(ArenaBlock) + blockSize);
+    block->next = arena->blocks;
+    block->size = blockSize;
+    arena->blocks = block;
+    arena->top = (uint8_t *)(block + 1);
+    arena->end = arena->top + blockSize;
+  }
+
+  void *result = arena->top;
+  arena->top += size;
+  arena->last = result;
+
+  if (ptr != NULL) {
+    memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+  }
+  return result;
+}
 
-void *reallocate(void *ptr, size_t oldSize, size_t newSize) {
-  if (newSize == 0) {
-    free(ptr);
+void freeArena(VM *vm, Arena *arena) {
+  ArenaBlock *block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    reallocate(vm, block, sizeof(ArenaBlock) + block->size, 0);
+    block = next;
+  }
+  initArena(arena);
+}
+
+/**
+ * Move a block to one of newSize bytes, or free it if newSize is 0. Return
+ * NULL, leaving the block alone, if there isn't enough memory.
+ */
+static void *resizeBlock(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+  bool oldPooled = ptr != NULL && isPooled(oldSize);
+  bool newPooled = isPooled(newSize);
+
+  if (!oldPooled && !newPooled) {
+    if (newSize == 0) {
+      free(ptr);
+      return NULL;
+    }
+    return realloc(ptr, newSize);
+  }
+
+  if (oldPooled && newPooled && sizeClass(oldSize) == sizeClass(newSize)) {
+    return ptr;
+  }
+
+  void *result = NULL;
+  if (newSize > 0) {
+    result = newPooled ? poolAllocate(vm, newSize) : malloc(newSize);
+    if (result == NULL) {
+      return NULL;
+    }
+  }
+
+  if (ptr != NULL) {
+    if (result != NULL) {
+      memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+
+    if (oldPooled) {
+      poolRelease(vm, ptr, oldSize);
+    } else {
+      free(ptr);
+    }
+  }
+
+  return result;
+}
+
+/**
+ * reallocate without the chance of triggering a collection, for use by the
+ * collector itself. Return NULL if there isn't enough memory.
+ */
+static void *tryResize(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+  void *result = resizeBlock(vm, ptr, oldSize, newSize);
+  if (result == NULL && newSize > 0) {
     return NULL;
   }
 
-  void *result = realloc(ptr, newSize);
+  vm->bytesAllocated += newSize - oldSize;
+  if (vm->bytesAllocated > vm->peakBytes) {
+    vm->peakBytes = vm->bytesAllocated;
+  }
+  if (ptr == NULL) {
+    vm->allocationCount++;
+  } else if (newSize == 0) {
+    vm->freeCount++;
+  }
+
+  return result;
+}
 
-  if (result == NULL) {
+static void *resize(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+  void *result = tryResize(vm, ptr, oldSize, newSize);
+  if (result == NULL && newSize > 0) {
     fprintf(stderr, "realloc failed.\n");
     exit(1);
   }
   return result;
 }
 
-static void freeObject(Obj *object) {
-  switch (object->type) {
+static uint64_t nowNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void recordPause(VM *vm, uint64_t start) {
+  uint64_t pause = nowNanos() - start;
+  uint64_t micros = pause / 1000;
+
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (uint64_t)1 << bucket) {
+    bucket++;
+  }
+
+  vm->gcPauses[bucket]++;
+  vm->gcPauseCount++;
+  if (pause > vm->gcPauseMax) {
+    vm->gcPauseMax = pause;
+  }
+}
+
+/**
+ * Return whether the collector should take a step before size more bytes are
+ * allocated in the old generation.
+ */
+static bool stepDue(VM *vm, size_t size) {
+  if (vm->gcPhase == GC_IDLE) {
+    return vm->bytesAllocated + size > vm->nextGC;
+  }
+
+  vm->gcDebt += size;
+  if (vm->gcDebt < GC_STEP_BYTES) {
+    return false;
+  }
+  vm->gcDebt -= GC_STEP_BYTES;
+  return true;
+}
+
+static void gcStep(VM *vm, int budget);
+
+/**
+ * Return whether allocating size more bytes would take the heap past its
+ * limit. The limit only holds while a script runs, since that is the only
+ * time an error can unwind cleanly.
+ */
+static bool overHeapLimit(VM *vm, size_t size) {
+  return vm->heapLimit > 0 && vm->errorHandler != NULL &&
+         vm->bytesAllocated + size > vm->heapLimit;
+}
+
+static void outOfMemory(VM *vm) {
+  if (vm->errorHandler == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  throwRuntimeError(vm, "Out of memory.");
+}
+
+/**
+ * Make room for size more bytes under the heap limit with a full collection,
+ * or fail the script if that doesn't free enough.
+ */
+static void enforceHeapLimit(VM *vm, size_t size) {
+  if (overHeapLimit(vm, size)) {
+    collectGarbage(vm);
+    if (overHeapLimit(vm, size)) {
+      outOfMemory(vm);
+    }
+  }
+}
+
+void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+  if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
+#endif
+
+    if (stepDue(vm, newSize - oldSize)) {
+      uint64_t start = nowNanos();
+      gcStep(vm, vm->gcStepBudget);
+      recordPause(vm, start);
+    }
+
+    enforceHeapLimit(vm, newSize - oldSize);
+  }
+
+  void *result = tryResize(vm, ptr, oldSize, newSize);
+  if (result == NULL && newSize > 0) {
+    // Give back whatever the collector can find and try once more.
+    collectGarbage(vm);
+    result = tryResize(vm, ptr, oldSize, newSize);
+    if (result == NULL) {
+      outOfMemory(vm);
+    }
+  }
+  return result;
+}
+
+void *allocateYoung(VM *vm, size_t size) {
+  // Keep every object 8-byte aligned.
+  size = (size + 7) & ~(size_t)7;
+  if (size > NURSERY_MAX_OBJECT) {
+    return NULL;
+  }
+
+#ifdef DEBUG_STRESS_GC
+  bool full = true;
+#else
+  bool full = vm->nurseryTop + size > vm->nursery + NURSERY_SIZE;
+#endif
+
+  if (full) {
+    collectNursery(vm);
+    // Promotion bypasses reallocate, so check the limit here instead.
+    enforceHeapLimit(vm, 0);
+  }
+
+  void *result = vm->nurseryTop;
+  vm->nurseryTop += size;
+  return result;
+}
+
+static void rememberObject(VM *vm, Obj *object) {
+  if (isRemembered(object) || isYoung(vm, object)) {
+    return;
+  }
+
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->rememberedSet = (Obj **)realloc(
+        vm->rememberedSet, sizeof(Obj *) * vm->rememberedCapacity);
+
+    if (vm->rememberedSet == NULL) {
+      fprintf(stderr, "realloc failed.\n");
+      exit(1);
+    }
+  }
+
+  setRemembered(object, true);
+  vm->rememberedSet[vm->rememberedCount++] = object;
+}
+
+void writeBarrier(VM *vm, Obj *object, Value value) {
+  if (!IS_OBJ(value)) {
+    return;
+  }
+
+  if (isYoung(vm, AS_OBJ(value))) {
+    rememberObject(vm, object);
+    return;
+  }
+
+  // A black object must never point to a white one, or marking would miss
+  // it.
+  if (vm->gcPhase == GC_MARK && isMarked(object)) {
+    markObject(vm, AS_OBJ(value));
+  }
+}
+
+void shadeValue(VM *vm, Value value) {
+  if (vm->gcPhase == GC_MARK) {
+    markValue(vm, value);
+  }
+}
+
+static size_t objectSize(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_ROPE:
+    return sizeof(ObjRope);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_LIST:
+    return sizeof(ObjList);
+  case OBJ_MAP:
+    return sizeof(ObjMap);
+  case OBJ_FLOAT_ARRAY:
+    return sizeof(ObjFloatArray) +
+           sizeof(double) * ((ObjFloatArray *)object)->count;
+  }
+
+  return 0;
+}
+
+static void pushGray(VM *vm, Obj *object) {
+  // The gray stack is the collector's own bookkeeping, so it is allocated
+  // outside of reallocate to keep it from triggering a collection itself.
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack =
+        (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+
+    if (vm->grayStack == NULL) {
+      fprintf(stderr, "realloc failed.\n");
+      exit(1);
+    }
+  }
+
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+void markObject(VM *vm, Obj *object) {
+  // Young objects are found by the minor collection that ends marking.
+  if (object == NULL || isMarked(object) || isYoung(vm, object)) {
+    return;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  setMarked(object, true);
+  pushGray(vm, object);
+}
+
+void markValue(VM *vm, Value value) {
+  if (IS_OBJ(value)) {
+    markObject(vm, AS_OBJ(value));
+  }
+}
+
+/**
+ * One of the threads taking part in a parallel mark. Each has a private mark
+ * stack, and a shared one that it hands work over to when the other threads
+ * may be running out. Idle threads steal from the shared stacks.
+ */
+typedef struct MarkThread {
+  VM *vm;
+  struct MarkThreads *all;
+  pthread_t thread;
+
+  int count;
+  int capacity;
+  Obj **stack;
+
+  pthread_mutex_t lock;
+  int sharedCount;
+  int sharedCapacity;
+  Obj **shared;
+} MarkThread;
+
+typedef struct MarkThreads {
+  int count;
+  // How many threads have run out of work, updated atomically.
+  int idle;
+  MarkThread threads[GC_MAX_THREADS];
+} MarkThreads;
 
+// A thread only shares work once it has more than this to spare.
+#define MARK_SHARE_MIN 64
+
+static void reserveWork(Obj ***stack, int *capacity, int count) {
+  if (*capacity >= count) {
+    return;
+  }
+
+  while (*capacity < count) {
+    *capacity = GROW_CAPACITY(*capacity);
+  }
+  *stack = (Obj **)realloc(*stack, sizeof(Obj *) * *capacity);
+
+  if (*stack == NULL) {
+    fprintf(stderr, "realloc failed.\n");
+    exit(1);
+  }
+}
+
+static void pushWork(MarkThread *thread, Obj *object) {
+  reserveWork(&thread->stack, &thread->capacity, thread->count + 1);
+  thread->stack[thread->count++] = object;
+}
+
+static void markParallel(MarkThread *thread, Obj *object) {
+  if (object == NULL || isYoung(thread->vm, object)) {
+    return;
+  }
+  // Another thread may be marking the same object.
+  if ((__atomic_load_n(&object->header, __ATOMIC_RELAXED) & OBJ_MARKED) ||
+      (__atomic_fetch_or(&object->header, OBJ_MARKED, __ATOMIC_RELAXED) &
+       OBJ_MARKED)) {
+    return;
+  }
+
+  pushWork(thread, object);
+}
+
+/**
+ * Mark object with markObject(), or on thread's own mark stack during a
+ * parallel mark.
+ */
+static void markReference(VM *vm, MarkThread *thread, Obj *object) {
+  if (thread != NULL) {
+    markParallel(thread, object);
+  } else {
+    markObject(vm, object);
+  }
+}
+
+static void markArray(VM *vm, MarkThread *thread, ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    if (IS_OBJ(array->values[i])) {
+      markReference(vm, thread, AS_OBJ(array->values[i]));
+    }
+  }
+}
+
+/**
+ * Mark everything an object refers to, turning it from gray to black.
+ */
+static void blackenObject(VM *vm, MarkThread *thread, Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  switch (objType(object)) {
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
-    freeChunk(&function->chunk);
-    FREE(OBJ_FUNCTION, object);
+    markReference(vm, thread, (Obj *)function->name);
+    markArray(vm, thread, &function->chunk.constants);
+    break;
+  }
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    markReference(vm, thread, rope->left);
+    markReference(vm, thread, rope->right);
+    markReference(vm, thread, (Obj *)rope->flat);
     break;
   }
-  case OBJ_STRING: {
-    ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+  case OBJ_LIST:
+    markArray(vm, thread, &((ObjList *)object)->items);
+    break;
+  case OBJ_MAP: {
+    MapTable *table = &((ObjMap *)object)->table;
+    // Removed entries have a NULL key and a nil value, which mark nothing.
+    for (int i = 0; i < table->entryCount; i++) {
+      MapEntry *entry = table->entries + i;
+      if (IS_OBJ(entry->key)) {
+        markReference(vm, thread, AS_OBJ(entry->key));
+      }
+      if (IS_OBJ(entry->value)) {
+        markReference(vm, thread, AS_OBJ(entry->value));
+      }
+    }
     break;
   }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+  case OBJ_FLOAT_ARRAY:
+    break;
   }
 }
 
-void freeObjects(VM *vm) {
-  Obj *object = vm->objects;
+/**
+ * Move work from victim's shared stack to thread's private one: all of it if
+ * it is thread's own, otherwise half. Return false if there was none.
+ */
+static bool takeWork(MarkThread *thread, MarkThread *victim) {
+  if (__atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&victim->lock);
+  int count = __atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED);
+  int take = victim == thread ? count : (count + 1) / 2;
+  for (int i = count - take; i < count; i++) {
+    pushWork(thread, victim->shared[i]);
+  }
+  __atomic_store_n(&victim->sharedCount, count - take, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&victim->lock);
+
+  return take > 0;
+}
+
+/**
+ * If the shared stack has run dry, move half of the private stack there for
+ * other threads to steal.
+ */
+static void shareWork(MarkThread *thread) {
+  if (thread->count < MARK_SHARE_MIN ||
+      __atomic_load_n(&thread->sharedCount, __ATOMIC_RELAXED) > 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&thread->lock);
+  // Only this thread adds to its shared stack, so it is still empty.
+  int give = thread->count / 2;
+  reserveWork(&thread->shared, &thread->sharedCapacity, give);
+  // Give away the oldest entries, which tend to lead to the most work.
+  memcpy(thread->shared, thread->stack, sizeof(Obj *) * give);
+  memmove(thread->stack, thread->stack + give,
+          sizeof(Obj *) * (thread->count - give));
+  thread->count -= give;
+  __atomic_store_n(&thread->sharedCount, give, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&thread->lock);
+}
+
+static bool stealWork(MarkThread *thread) {
+  MarkThreads *all = thread->all;
+  int self = (int)(thread - all->threads);
+
+  for (int i = 1; i < all->count; i++) {
+    if (takeWork(thread, &all->threads[(self + i) % all->count])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Wait until there is work to steal, or every thread is out of work. Return
+ * false in the second case.
+ */
+static bool waitForWork(MarkThread *thread) {
+  MarkThreads *all = thread->all;
+  __atomic_add_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+
+  // An idle thread never makes more work, so once all of them are idle there
+  // is none left anywhere.
+  while (__atomic_load_n(&all->idle, __ATOMIC_SEQ_CST) < all->count) {
+    for (int i = 0; i < all->count; i++) {
+      MarkThread *victim = &all->threads[i];
+      if (victim == thread ||
+          __atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED) == 0) {
+        continue;
+      }
+
+      __atomic_sub_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+      if (takeWork(thread, victim)) {
+        return true;
+      }
+      __atomic_add_fetch(&all->idle, 1, __ATOMIC_SEQ_CST);
+    }
+    sched_yield();
+  }
+
+  return false;
+}
+
+static void *runMarkThread(void *arg) {
+  MarkThread *thread = (MarkThread *)arg;
+
+  do {
+    while (thread->count > 0) {
+      Obj *object = thread->stack[--thread->count];
+      blackenObject(thread->vm, thread, object);
+      shareWork(thread);
+
+      if (thread->count == 0) {
+        takeWork(thread, thread);
+      }
+    }
+  } while (stealWork(thread) || waitForWork(thread));
+
+  return NULL;
+}
+
+/**
+ * Blacken everything on the gray stack and all it leads to, spreading the
+ * work over vm->gcThreads threads. The calling thread is one of them.
+ */
+static void traceParallel(VM *vm) {
+  MarkThreads all;
+  all.count = vm->gcThreads < GC_MAX_THREADS ? vm->gcThreads : GC_MAX_THREADS;
+  all.idle = 0;
+
+  for (int i = 0; i < all.count; i++) {
+    MarkThread *thread = &all.threads[i];
+    thread->vm = vm;
+    thread->all = &all;
+    thread->count = 0;
+    thread->capacity = 0;
+    thread->stack = NULL;
+    pthread_mutex_init(&thread->lock, NULL);
+    thread->sharedCount = 0;
+    thread->sharedCapacity = 0;
+    thread->shared = NULL;
+  }
+
+  // Deal the roots out evenly to start with.
+  for (int i = 0; i < vm->grayCount; i++) {
+    pushWork(&all.threads[i % all.count], vm->grayStack[i]);
+  }
+  vm->grayCount = 0;
+
+  int started = 1;
+  for (; started < all.count; started++) {
+    MarkThread *thread = &all.threads[started];
+    if (pthread_create(&thread->thread, NULL, runMarkThread, thread) != 0) {
+      break;
+    }
+  }
+  if (started < all.count) {
+    // Carry on with fewer threads. The ones that didn't start still have
+    // their share of the roots, so take them back.
+    for (int i = started; i < all.count; i++) {
+      MarkThread *thread = &all.threads[i];
+      for (int j = 0; j < thread->count; j++) {
+        pushWork(&all.threads[0], thread->stack[j]);
+      }
+      thread->count = 0;
+      // Idle for good, so that the others can finish without it.
+      __atomic_add_fetch(&all.idle, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+
+  runMarkThread(&all.threads[0]);
+
+  for (int i = 0; i < all.count; i++) {
+    MarkThread *thread = &all.threads[i];
+    if (i > 0 && i < started) {
+      pthread_join(thread->thread, NULL);
+    }
+    pthread_mutex_destroy(&thread->lock);
+    free(thread->stack);
+    free(thread->shared);
+  }
+}
+
+static void freeObject(VM *vm, Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)object, objType(object));
+#endif
+
+  switch (objType(object)) {
+
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    freeChunk(vm, &function->chunk);
+    FREE(vm, ObjFunction, object);
+    break;
+  }
+  case OBJ_STRING:
+  case OBJ_FLOAT_ARRAY: {
+    reallocate(vm, object, objectSize(object), 0);
+    break;
+  }
+  case OBJ_ROPE: {
+    FREE(vm, ObjRope, object);
+    break;
+  }
+  case OBJ_NATIVE: {
+    FREE(vm, ObjNative, object);
+    break;
+  }
+  case OBJ_LIST: {
+    freeValueArray(vm, &((ObjList *)object)->items);
+    FREE(vm, ObjList, object);
+    break;
+  }
+  case OBJ_MAP: {
+    freeMapTable(vm, &((ObjMap *)object)->table);
+    FREE(vm, ObjMap, object);
+    break;
+  }
+  }
+}
+
+/**
+ * Mark the roots that change too often to put behind a write barrier. They are
+ * scanned again when marking finishes.
+ */
+static void markRoots(VM *vm) {
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
+  }
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj *)vm->frames[i].function);
+  }
+
+  markCompilerRoots(vm);
+}
+
+static void traceReferences(VM *vm) {
+  if (vm->gcThreads > 1) {
+    traceParallel(vm);
+    return;
+  }
+
+  while (vm->grayCount > 0) {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, NULL, object);
+  }
+}
+
+/**
+ * If object is young, copy it to the old generation, leave a forwarding
+ * pointer behind, and point *slot at the copy.
+ */
+static void evacuate(VM *vm, Obj **slot) {
+  Obj *object = *slot;
+  if (object == NULL || !isYoung(vm, object)) {
+    return;
+  }
+
+  if (objNext(object) != NULL) {
+    // Already promoted.
+    *slot = objNext(object);
+    return;
+  }
+
+  size_t size = objectSize(object);
+  Obj *promoted = (Obj *)resize(vm, NULL, 0, size);
+  memcpy(promoted, object, size);
+
+  setObjNext(object, promoted);
+  *slot = promoted;
+
+  // Its references still need evacuating too. This isn't the gray stack,
+  // which may be in the middle of an incremental mark.
+  setObjNext(promoted, vm->promoted);
+  vm->promoted = promoted;
+}
+
+static void evacuateValue(VM *vm, Value *slot) {
+  if (IS_OBJ(*slot)) {
+    evacuate(vm, &slot->as.obj);
+  }
+}
+
+static void evacuateString(VM *vm, ObjString **slot) {
+  Obj *object = (Obj *)*slot;
+  evacuate(vm, &object);
+  *slot = (ObjString *)object;
+}
+
+/**
+ * Evacuate everything an object refers to.
+ */
+static void scanReferences(VM *vm, Obj *object) {
+  switch (objType(object)) {
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    evacuateString(vm, &function->name);
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+      evacuateValue(vm, &constants->values[i]);
+    }
+    break;
+  }
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    evacuate(vm, &rope->left);
+    evacuate(vm, &rope->right);
+    evacuateString(vm, &rope->flat);
+    break;
+  }
+  case OBJ_LIST: {
+    ValueArray *items = &((ObjList *)object)->items;
+    for (int i = 0; i < items->count; i++) {
+      evacuateValue(vm, &items->values[i]);
+    }
+    break;
+  }
+  case OBJ_MAP: {
+    MapTable *table = &((ObjMap *)object)->table;
+    for (int i = 0; i < table->entryCount; i++) {
+      evacuateValue(vm, &table->entries[i].key);
+      evacuateValue(vm, &table->entries[i].value);
+    }
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+  case OBJ_FLOAT_ARRAY:
+    break;
+  }
+}
+
+static void minorCollection(VM *vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    evacuateValue(vm, slot);
+  }
+
+  for (int i = 0; i < vm->globals.capacity; i++) {
+    evacuateValue(vm, &vm->globals.entries[i].value);
+  }
+
+  // Functions, including the one being compiled, and the keys of
+  // vm->strings and vm->globals are never young.
+
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    Obj *object = vm->rememberedSet[i];
+    setRemembered(object, false);
+    scanReferences(vm, object);
+  }
+  vm->rememberedCount = 0;
+
+  while (vm->promoted != NULL) {
+    Obj *object = vm->promoted;
+    vm->promoted = objNext(object);
+    setObjNext(object, vm->objects);
+    vm->objects = object;
+
+    scanReferences(vm, object);
+    // Like any other object allocated in the old generation while marking,
+    // promoted ones start out black.
+    if (vm->gcPhase == GC_MARK) {
+      markObject(vm, object);
+    }
+  }
+
+  // Everything left in the nursery is garbage, and none of it owns memory
+  // elsewhere, so there is nothing to free.
+  vm->nurseryTop = vm->nursery;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm->bytesAllocated - before);
+#endif
+}
+
+void collectNursery(VM *vm) {
+  uint64_t start = nowNanos();
+  size_t before = vm->bytesAllocated;
+  minorCollection(vm);
+
+  // Promoted objects count as allocated in the old generation.
+  vm->gcDebt += vm->bytesAllocated - before;
+  if (stepDue(vm, 0)) {
+    gcStep(vm, vm->gcStepBudget);
+  }
+  recordPause(vm, start);
+}
+
+static void startCycle(VM *vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+
+  vm->gcPhase = GC_MARK;
+  vm->gcDebt = 0;
+  // Globals are only scanned here. Stores into them are shaded instead.
+  markTable(vm, &vm->globals);
+  markRoots(vm);
+}
+
+/**
+ * The last part of marking, which can't be done incrementally.
+ */
+static void finishMarking(VM *vm) {
+  // Promote everything young that is alive, marking it as it goes.
+  minorCollection(vm);
+  markRoots(vm);
+  traceReferences(vm);
+
+  // Interned strings don't keep themselves alive; drop the ones about to be
+  // freed before the table is left pointing at them.
+  stringSetRemoveWhite(&vm->strings);
+
+  // Objects allocated from here on go on a fresh list and aren't swept.
+  vm->sweepList = vm->objects;
+  vm->objects = NULL;
+  vm->gcPhase = GC_SWEEP;
+}
+
+static void markStep(VM *vm, int budget) {
+  // Parallel marking is for throughput, so it isn't incremental: the first
+  // step marks everything.
+  if (vm->gcThreads > 1) {
+    traceReferences(vm);
+  }
+
+  while (vm->grayCount > 0 && budget-- > 0) {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, NULL, object);
+  }
+
+  if (vm->grayCount == 0) {
+    finishMarking(vm);
+  }
+}
+
+static void sweepStep(VM *vm, int budget) {
+  while (vm->sweepList != NULL && budget-- > 0) {
+    Obj *object = vm->sweepList;
+    vm->sweepList = objNext(object);
+
+    if (!isMarked(object)) {
+      freeObject(vm, object);
+      continue;
+    }
+
+    // Reset for the next collection.
+    setMarked(object, false);
+    setObjNext(object, vm->objects);
+    vm->objects = object;
+  }
+
+  if (vm->sweepList == NULL) {
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = (size_t)(vm->bytesAllocated * vm->heapGrowFactor);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes left, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+  }
+}
+
+/**
+ * Do at most budget objects' worth of collection work.
+ */
+static void gcStep(VM *vm, int budget) {
+  switch (vm->gcPhase) {
+  case GC_IDLE:
+    startCycle(vm);
+    break;
+  case GC_MARK:
+    markStep(vm, budget);
+    break;
+  case GC_SWEEP:
+    sweepStep(vm, budget);
+    break;
+  }
+}
+
+static void finishCycle(VM *vm) {
+  while (vm->gcPhase != GC_IDLE) {
+    gcStep(vm, INT_MAX);
+  }
+}
+
+void collectGarbage(VM *vm) {
+  uint64_t start = nowNanos();
+
+  // Objects that died during the cycle in progress may have been marked
+  // already, so run a whole new one after it.
+  finishCycle(vm);
+  startCycle(vm);
+  finishCycle(vm);
+
+  recordPause(vm, start);
+}
+
+uint64_t gcPausePercentile(VM *vm, double fraction) {
+  uint64_t target = (uint64_t)(fraction * vm->gcPauseCount);
+  uint64_t seen = 0;
+
+  for (int i = 0; i < GC_PAUSE_BUCKETS - 1; i++) {
+    seen += vm->gcPauses[i];
+    if (seen > target || seen == vm->gcPauseCount) {
+      return (uint64_t)1 << i;
+    }
+  }
+
+  return vm->gcPauseMax / 1000;
+}
+
+void printGCPauses(VM *vm) {
+  fprintf(stderr, "gc pauses: %llu, max %.1f us\n",
+          (unsigned long long)vm->gcPauseCount, vm->gcPauseMax / 1000.0);
+
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (vm->gcPauses[i] == 0) {
+      continue;
+    }
+
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "  >= %llu us: ", 1ULL << (i - 1));
+    } else {
+      fprintf(stderr, "  < %llu us: ", 1ULL << i);
+    }
+    fprintf(stderr, "%llu\n", (unsigned long long)vm->gcPauses[i]);
+  }
+
+  fprintf(stderr, "p50 < %llu us, p99 < %llu us\n",
+          (unsigned long long)gcPausePercentile(vm, 0.5),
+          (unsigned long long)gcPausePercentile(vm, 0.99));
+}
+
+static size_t chunkCodeBytes(Chunk *chunk) {
+  return sizeof(uint8_t) * chunk->capacity +
+         sizeof(LineRun) * chunk->lineCapacity;
+}
+
+static void statObjects(MemoryStats *stats, Obj *object) {
+  for (; object != NULL; object = objNext(object)) {
+    ObjType type = objType(object);
+    stats->objectCount[type]++;
+    stats->objectBytes[type] += objectSize(object);
+
+    if (type == OBJ_FUNCTION) {
+      Chunk *chunk = &((ObjFunction *)object)->chunk;
+      stats->codeBytes += chunkCodeBytes(chunk);
+      stats->constantBytes += sizeof(Value) * chunk->constants.capacity +
+                              sizeof(int) * chunk->constantIndexCapacity;
+    }
+    if (type == OBJ_LIST) {
+      stats->objectBytes[type] +=
+          sizeof(Value) * ((ObjList *)object)->items.capacity;
+    }
+    if (type == OBJ_MAP) {
+      stats->objectBytes[type] += mapTableBytes(&((ObjMap *)object)->table);
+    }
+  }
+}
+
+void getMemoryStats(VM *vm, MemoryStats *stats) {
+  memset(stats, 0, sizeof(MemoryStats));
+  stats->liveBytes = vm->bytesAllocated;
+  stats->peakBytes = vm->peakBytes;
+  stats->allocations = vm->allocationCount;
+  stats->frees = vm->freeCount;
+
+  statObjects(stats, vm->objects);
+  statObjects(stats, vm->sweepList);
+  stats->tableBytes =
+      tableBytes(vm->globals.capacity) + stringSetBytes(vm->strings.capacity);
+  stats->nurseryBytes = (size_t)(vm->nurseryTop - vm->nursery);
+}
+
+void printMemoryStats(VM *vm) {
+  static const char *typeNames[OBJ_TYPE_COUNT] = {
+      [OBJ_STRING] = "strings",
+      [OBJ_ROPE] = "ropes",
+      [OBJ_FUNCTION] = "functions",
+      [OBJ_NATIVE] = "natives",
+      [OBJ_LIST] = "lists",
+      [OBJ_MAP] = "maps",
+      [OBJ_FLOAT_ARRAY] = "arrays",
+  };
+
+  MemoryStats stats;
+  getMemoryStats(vm, &stats);
+
+  fprintf(stderr, "memory: %zu bytes live, %zu peak\n", stats.liveBytes,
+          stats.peakBytes);
+  fprintf(stderr, "  %llu allocations, %llu frees\n",
+          (unsigned long long)stats.allocations,
+          (unsigned long long)stats.frees);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(stderr, "  %-10s %8zu objects %10zu bytes\n", typeNames[i],
+            stats.objectCount[i], stats.objectBytes[i]);
+  }
+  fprintf(stderr, "  code       %27zu bytes\n", stats.codeBytes);
+  fprintf(stderr, "  constants  %27zu bytes\n", stats.constantBytes);
+  fprintf(stderr, "  tables     %27zu bytes\n", stats.tableBytes);
+  fprintf(stderr, "  nursery    %27zu bytes\n", stats.nurseryBytes);
+}
+
+static void freeList(VM *vm, Obj *object) {
   while (object != NULL) {
-    Obj *next = object->next;
-    freeObject(object);
+    Obj *next = objNext(object);
+    freeObject(vm, object);
     object = next;
   }
 }
+
+void freeObjects(VM *vm) {
+  freeList(vm, vm->objects);
+  freeList(vm, vm->sweepList);
+
+  free(vm->grayStack);
+  free(vm->rememberedSet);
+
+  // Everything pooled has been released by now.
+  void *slab = vm->poolSlabs;
+  while (slab != NULL) {
+    void *next = *(void **)slab;
+    free(slab);
+    slab = next;
+  }
+}
@@ -5,20 +5,140 @@
 #include "object.h"
 #include "vm.h"
 
-#define ALLOCATE(type, count)                                                  \
-  (type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count)                                              \
+  (type *)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
-  (type *)reallocate(pointer, sizeof(type) * (oldCount),                       \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)                      \
+  (type *)reallocate(vm, pointer, sizeof(type) * (oldCount),                   \
                      sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount)                                    \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount)                                \
+  reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
-void *reallocate(void *ptr, size_t oldSize, size_t newSize);
+// After a collection, the next one runs once the heap has grown by this
+// factor. Can be changed per VM through vm->heapGrowFactor.
+#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated before the first collection.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+// Once a cycle has started, the collector takes an incremental step for
+// every GC_STEP_BYTES allocated, marking or sweeping at most vm->gcStepBudget
+// objects in it.
+#define GC_STEP_BYTES (64 * 1024)
+#define GC_STEP_BUDGET 1024
+
+// The most threads vm->gcThreads can ask for to mark in parallel.
+#define GC_MAX_THREADS 64
+
+// Short-lived objects are bump-allocated in a nursery of this size, and the
+// ones still alive when it fills up are promoted to the old generation.
+#define NURSERY_SIZE (256 * 1024)
+// Anything bigger goes straight to the old generation.
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+
+/**
+ * All memory the VM owns goes through here, so that it can keep track of how
+ * much is allocated and collect garbage when that grows too large.
+ */
+void *reallocate(VM *vm, void *ptr, size_t oldSize, size_t newSize);
+/**
+ * Bump-allocate size bytes in the nursery, running a minor collection first
+ * if it's full. Return NULL if size is too big for the nursery.
+ */
+void *allocateYoung(VM *vm, size_t size);
+
+/**
+ * A bump allocator for scratch data that is all freed at once. Its blocks are
+ * allocated with reallocate.
+ */
+typedef struct Arena {
+  struct ArenaBlock *blocks;
+  uint8_t *top;
+  uint8_t *end;
+  // The latest allocation, which can grow in place.
+  void *last;
+} Arena;
+
+// Arena blocks are at least this big.
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+void initArena(Arena *arena);
+/**
+ * Like reallocate, but for memory in arena. The old memory isn't freed until
+ * the whole arena is.
+ */
+void *arenaGrow(VM *vm, Arena *arena, void *ptr, size_t oldSize,
+                size_t newSize);
+void freeArena(VM *vm, Arena *arena);
+
+static inline bool isYoung(VM *vm, Obj *object) {
+  return (uint8_t *)object >= vm->nursery &&
+         (uint8_t *)object < vm->nursery + NURSERY_SIZE;
+}
+
+/**
+ * Must be called after storing value into a field of object, so that a minor
+ * collection finds young objects only old ones refer to, and so that
+ * incremental marking doesn't miss a white object stored into a black one.
+ */
+void writeBarrier(VM *vm, Obj *object, Value value);
+/**
+ * Must be called when value is stored somewhere the collector has already
+ * scanned and won't look at again this cycle, like vm->globals, or when it is
+ * revived from a weak set like vm->strings.
+ */
+void shadeValue(VM *vm, Value value);
+
+void markObject(VM *vm, Obj *object);
+void markValue(VM *vm, Value value);
+/**
+ * Promote everything alive in the nursery to the old generation, leaving the
+ * nursery empty.
+ */
+void collectNursery(VM *vm);
+/**
+ * Finish any collection in progress and then collect both generations in one
+ * go.
+ */
+void collectGarbage(VM *vm);
+
+/**
+ * Return the pause time in microseconds that fraction of all collector pauses
+ * so far stayed under, rounded up to a power of two.
+ */
+uint64_t gcPausePercentile(VM *vm, double fraction);
+void printGCPauses(VM *vm);
+
+typedef struct {
+  // Everything allocated through reallocate, which is all of the heap but
+  // the nursery and the collector's own bookkeeping.
+  size_t liveBytes;
+  size_t peakBytes;
+  uint64_t allocations;
+  uint64_t frees;
+
+  // Old objects, including garbage that hasn't been swept yet. Their sizes
+  // don't include chunks.
+  size_t objectCount[OBJ_TYPE_COUNT];
+  size_t objectBytes[OBJ_TYPE_COUNT];
+  // Bytecode and line numbers, and constant pools, of every function.
+  size_t codeBytes;
+  size_t constantBytes;
+  // The entry arrays of vm->globals and vm->strings.
+  size_t tableBytes;
+  // How much of the nursery is in use, dead objects included.
+  size_t nurseryBytes;
+} MemoryStats;
+
+/**
+ * Fill in stats for vm. The counters are kept as memory is allocated, the
+ * breakdown is worked out by walking the heap, so this isn't free.
+ */
+void getMemoryStats(VM *vm, MemoryStats *stats);
+void printMemoryStats(VM *vm);
 void freeObjects(VM *vm);
 #endif
\ No newline at end of file
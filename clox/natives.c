@@ -0,0 +1,407 @@
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+static ObjList *checkList(VM *vm, Value value, const char *name) {
+  if (!IS_LIST(value)) {
+    throwRuntimeError(vm, "%s() expects a list.", name);
+  }
+  return AS_LIST(value);
+}
+
+static ObjMap *checkMap(VM *vm, Value value, const char *name) {
+  if (!IS_MAP(value)) {
+    throwRuntimeError(vm, "%s() expects a map.", name);
+  }
+  return AS_MAP(value);
+}
+
+static ObjFloatArray *checkFloatArray(VM *vm, Value value,
+                                      const char *name) {
+  if (!IS_FLOAT_ARRAY(value)) {
+    throwRuntimeError(vm, "%s() expects an array.", name);
+  }
+  return AS_FLOAT_ARRAY(value);
+}
+
+static double checkNumber(VM *vm, Value value, const char *name) {
+  if (!IS_NUMBER(value)) {
+    throwRuntimeError(vm, "%s() expects a number.", name);
+  }
+  return AS_NUMBER(value);
+}
+
+static Value lenNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  if (IS_LIST(args[0])) {
+    return INT_VAL(AS_LIST(args[0])->items.count);
+  }
+  if (IS_MAP(args[0])) {
+    return INT_VAL(AS_MAP(args[0])->table.count);
+  }
+  if (IS_FLOAT_ARRAY(args[0])) {
+    return INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+  }
+  if (IS_SHORT_STRING(args[0])) {
+    return INT_VAL(shortStringLength(args[0]));
+  }
+  if (IS_STRING(args[0]) || IS_ROPE(args[0])) {
+    return INT_VAL(stringLength(AS_OBJ(args[0])));
+  }
+  throwRuntimeError(vm, "len() expects a list, map, array or string.");
+}
+
+static Value pushNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjList *list = checkList(vm, args[0], "push");
+  reserveValueArray(vm, &list->items, list->items.count + 1);
+
+  // Growing the buffer may have moved the value, so read it only now.
+  list->items.values[list->items.count++] = args[1];
+  writeBarrier(vm, (Obj *)list, args[1]);
+  return NIL_VAL;
+}
+
+static Value popNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjList *list = checkList(vm, args[0], "pop");
+  if (list->items.count == 0) {
+    throwRuntimeError(vm, "Can't pop from an empty list.");
+  }
+  return list->items.values[--list->items.count];
+}
+
+static int sliceBound(VM *vm, Value bound, int count) {
+  if (!IS_NUMBER(bound)) {
+    throwRuntimeError(vm, "slice() bounds must be numbers.");
+  }
+  double number = AS_NUMBER(bound);
+  if (!(number >= 0 && number <= count) || number != (int)number) {
+    throwRuntimeError(vm, "slice() bounds must be whole numbers from 0 to "
+                          "the length of the list.");
+  }
+  return (int)number;
+}
+
+/**
+ * slice(list, start, end) returns a new list of the elements from start up
+ * to but not including end.
+ */
+static Value sliceNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjList *list = checkList(vm, args[0], "slice");
+  int start = sliceBound(vm, args[1], list->items.count);
+  int end = sliceBound(vm, args[2], list->items.count);
+  if (start > end) {
+    throwRuntimeError(vm, "slice() start must not be after its end.");
+  }
+
+  int count = end - start;
+  ObjList *slice = newList(vm);
+  push(vm, OBJ_VAL(slice));
+  reserveValueArray(vm, &slice->items, count);
+
+  // Lists are never young, but their elements may have moved.
+  for (int i = 0; i < count; i++) {
+    Value value = list->items.values[start + i];
+    slice->items.values[i] = value;
+    writeBarrier(vm, (Obj *)slice, value);
+  }
+  slice->items.count = count;
+
+  pop(vm);
+  return OBJ_VAL(slice);
+}
+
+/**
+ * Order numbers ascending, with NaNs last. Every comparison with a NaN is
+ * false, so without that qsort would get an inconsistent order.
+ */
+static int compareNumbers(const void *a, const void *b) {
+  double x = AS_NUMBER(*(const Value *)a);
+  double y = AS_NUMBER(*(const Value *)b);
+  bool nanX = isnan(x);
+  bool nanY = isnan(y);
+  if (nanX || nanY) {
+    return nanX - nanY;
+  }
+  return (x > y) - (x < y);
+}
+
+/**
+ * Return the characters of a short or flat string, using buffer for a short
+ * one.
+ */
+static const char *stringChars(const Value *value, char *buffer,
+                               int *length) {
+  if (IS_SHORT_STRING(*value)) {
+    *length = shortStringChars(*value, buffer);
+    return buffer;
+  }
+
+  ObjString *string = AS_STRING(*value);
+  *length = string->length;
+  return string->chars;
+}
+
+static int compareStrings(const void *a, const void *b) {
+  char bufferA[SHORT_STRING_MAX];
+  char bufferB[SHORT_STRING_MAX];
+  int lengthA, lengthB;
+  const char *charsA = stringChars(a, bufferA, &lengthA);
+  const char *charsB = stringChars(b, bufferB, &lengthB);
+
+  int result = memcmp(charsA, charsB, lengthA < lengthB ? lengthA : lengthB);
+  return result != 0 ? result : lengthA - lengthB;
+}
+
+static bool isStringValue(Value value) {
+  return IS_SHORT_STRING(value) || IS_STRING(value) || IS_ROPE(value);
+}
+
+/**
+ * sort(list) sorts a list of numbers or a list of strings in place.
+ */
+static Value sortNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ValueArray *items = &checkList(vm, args[0], "sort")->items;
+
+  bool numbers = true;
+  bool strings = true;
+  for (int i = 0; i < items->count; i++) {
+    numbers = numbers && IS_NUMBER(items->values[i]);
+    strings = strings && isStringValue(items->values[i]);
+  }
+
+  if (numbers) {
+    qsort(items->values, items->count, sizeof(Value), compareNumbers);
+  } else if (strings) {
+    // Comparing reads the characters, so ropes need flattening first.
+    for (int i = 0; i < items->count; i++) {
+      if (IS_ROPE(items->values[i])) {
+        ObjString *flat = flattenRope(vm, AS_ROPE(items->values[i]));
+        items->values[i] = OBJ_VAL(flat);
+        writeBarrier(vm, AS_OBJ(args[0]), items->values[i]);
+      }
+    }
+    qsort(items->values, items->count, sizeof(Value), compareStrings);
+  } else {
+    throwRuntimeError(vm, "sort() expects a list of numbers or of strings.");
+  }
+
+  return NIL_VAL;
+}
+
+/**
+ * keys(map) returns a list of the map's keys, in the order they were added.
+ */
+static Value keysNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  MapTable *table = &checkMap(vm, args[0], "keys")->table;
+  ObjList *keys = newList(vm);
+  push(vm, OBJ_VAL(keys));
+  reserveValueArray(vm, &keys->items, table->count);
+
+  for (int i = 0; i < table->entryCount; i++) {
+    MapEntry *entry = table->entries + i;
+    if (!isRemovedEntry(entry)) {
+      keys->items.values[keys->items.count++] = entry->key;
+      writeBarrier(vm, (Obj *)keys, entry->key);
+    }
+  }
+
+  pop(vm);
+  return OBJ_VAL(keys);
+}
+
+static Value hasNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjMap *map = checkMap(vm, args[0], "has");
+  uint32_t hash = prepareMapKey(vm, &args[1]);
+  return BOOL_VAL(mapTableFind(&map->table, args[1], hash) != -1);
+}
+
+/**
+ * remove(map, key) removes key from the map and returns whether it was
+ * there.
+ */
+static Value removeNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjMap *map = checkMap(vm, args[0], "remove");
+  uint32_t hash = prepareMapKey(vm, &args[1]);
+  return BOOL_VAL(mapTableRemove(vm, &map->table, args[1], hash));
+}
+
+/**
+ * floatArray(n) returns an array of n zeros, and floatArray(list) one with
+ * the list's numbers.
+ */
+static Value floatArrayNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  if (IS_NUMBER(args[0])) {
+    double count = AS_NUMBER(args[0]);
+    if (!(count >= 0 && count <= INT_MAX) || count != (int)count) {
+      throwRuntimeError(vm, "floatArray() length must be a whole number.");
+    }
+    return OBJ_VAL(newFloatArray(vm, (int)count));
+  }
+
+  ObjList *list = checkList(vm, args[0], "floatArray");
+  for (int i = 0; i < list->items.count; i++) {
+    if (!IS_NUMBER(list->items.values[i])) {
+      throwRuntimeError(vm, "floatArray() expects a list of numbers.");
+    }
+  }
+
+  // Lists are never young, so list is still good after allocating.
+  ObjFloatArray *array = newFloatArray(vm, list->items.count);
+  for (int i = 0; i < list->items.count; i++) {
+    array->values[i] = AS_NUMBER(list->items.values[i]);
+  }
+  return OBJ_VAL(array);
+}
+
+/**
+ * Check that the arrays x and y have the same length, and return it.
+ */
+static int checkSameLength(VM *vm, Value x, Value y, const char *name) {
+  int count = checkFloatArray(vm, x, name)->count;
+  if (checkFloatArray(vm, y, name)->count != count) {
+    throwRuntimeError(vm, "%s() expects arrays of the same length.", name);
+  }
+  return count;
+}
+
+static Value sumNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjFloatArray *x = checkFloatArray(vm, args[0], "sum");
+  return NUMBER_VAL(floatKernels()->sum(x->values, x->count));
+}
+
+static Value dotNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  int count = checkSameLength(vm, args[0], args[1], "dot");
+  return NUMBER_VAL(floatKernels()->dot(AS_FLOAT_ARRAY(args[0])->values,
+                                        AS_FLOAT_ARRAY(args[1])->values,
+                                        count));
+}
+
+static Value minNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjFloatArray *x = checkFloatArray(vm, args[0], "min");
+  if (x->count == 0) {
+    throwRuntimeError(vm, "min() expects a non-empty array.");
+  }
+  return NUMBER_VAL(floatKernels()->min(x->values, x->count));
+}
+
+static Value maxNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjFloatArray *x = checkFloatArray(vm, args[0], "max");
+  if (x->count == 0) {
+    throwRuntimeError(vm, "max() expects a non-empty array.");
+  }
+  return NUMBER_VAL(floatKernels()->max(x->values, x->count));
+}
+
+/**
+ * scale(x, a) multiplies each element of x by a, in place.
+ */
+static Value scaleNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjFloatArray *x = checkFloatArray(vm, args[0], "scale");
+  double a = checkNumber(vm, args[1], "scale");
+  floatKernels()->scale(x->values, a, x->count);
+  return NIL_VAL;
+}
+
+/**
+ * axpy(a, x, y) adds a times each element of x to the same element of y, in
+ * place.
+ */
+static Value axpyNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  double a = checkNumber(vm, args[0], "axpy");
+  int count = checkSameLength(vm, args[1], args[2], "axpy");
+  floatKernels()->axpy(a, AS_FLOAT_ARRAY(args[1])->values,
+                       AS_FLOAT_ARRAY(args[2])->values, count);
+  return NIL_VAL;
+}
+
+/**
+ * add(x, y) and mul(x, y) return a new array of the elementwise sums or
+ * products.
+ */
+static Value addNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  int count = checkSameLength(vm, args[0], args[1], "add");
+  ObjFloatArray *out = newFloatArray(vm, count);
+  // Allocating may have moved x and y, so read them only now.
+  floatKernels()->add(AS_FLOAT_ARRAY(args[0])->values,
+                      AS_FLOAT_ARRAY(args[1])->values, out->values, count);
+  return OBJ_VAL(out);
+}
+
+static Value mulNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  int count = checkSameLength(vm, args[0], args[1], "mul");
+  ObjFloatArray *out = newFloatArray(vm, count);
+  floatKernels()->mul(AS_FLOAT_ARRAY(args[0])->values,
+                      AS_FLOAT_ARRAY(args[1])->values, out->values, count);
+  return OBJ_VAL(out);
+}
+
+/**
+ * prefixSum(x) replaces each element of x with the sum of it and those
+ * before it. Each sum depends on the last, so this has no vector kernel.
+ */
+static Value prefixSumNative(VM *vm, int argCount, Value *args) {
+  (void)argCount;
+  ObjFloatArray *x = checkFloatArray(vm, args[0], "prefixSum");
+  double sum = 0;
+  for (int i = 0; i < x->count; i++) {
+    sum += x->values[i];
+    x->values[i] = sum;
+  }
+  return NIL_VAL;
+}
+
+static void defineNative(VM *vm, const char *name, NativeFn function,
+                         int arity) {
+  // Keep both on the stack in case allocating the other collects.
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity)));
+  tableSet(vm, &vm->globals, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+  pop(vm);
+  pop(vm);
+}
+
+void defineNatives(VM *vm) {
+  defineNative(vm, "len", lenNative, 1);
+  defineNative(vm, "push", pushNative, 2);
+  defineNative(vm, "pop", popNative, 1);
+  defineNative(vm, "slice", sliceNative, 3);
+  defineNative(vm, "sort", sortNative, 1);
+  defineNative(vm, "keys", keysNative, 1);
+  defineNative(vm, "has", hasNative, 2);
+  defineNative(vm, "remove", removeNative, 2);
+  defineNative(vm, "floatArray", floatArrayNative, 1);
+  defineNative(vm, "sum", sumNative, 1);
+  defineNative(vm, "dot", dotNative, 2);
+  defineNative(vm, "min", minNative, 1);
+  defineNative(vm, "max", maxNative, 1);
+  defineNative(vm, "scale", scaleNative, 2);
+  defineNative(vm, "axpy", axpyNative, 3);
+  defineNative(vm, "add", addNative, 2);
+  defineNative(vm, "mul", mulNative, 2);
+  defineNative(vm, "prefixSum", prefixSumNative, 1);
+}
@@ -0,0 +1,11 @@
+#ifndef clox_natives_h
+#define clox_natives_h
+
+#include "vm.h"
+
+/**
+ * Define the built-in functions as globals of vm.
+ */
+void defineNatives(VM *vm);
+
+#endif
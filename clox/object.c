@@ -1,9 +1,12 @@
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
+#include "hash.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -12,13 +15,42 @@
 
 #define ALLOCATE_OBJ(vm, type, objectType)                                     \
   (type *)allocateObject(vm, sizeof(type), objectType)
+#define ALLOCATE_YOUNG_OBJ(vm, type, objectType)                               \
+  (type *)allocateYoungObject(vm, sizeof(type), objectType)
 
 static Obj *allocateObject(VM *vm, size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
-  object->type = type;
+  Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
+  object->header = (uint64_t)type << OBJ_TYPE_SHIFT;
+  // Allocate black while marking, since nothing will scan for it.
+  setMarked(object, vm->gcPhase == GC_MARK);
 
-  object->next = vm->objects;
+  setObjNext(object, vm->objects);
   vm->objects = object;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
+
+  return object;
+}
+
+/**
+ * Allocate an object in the nursery. Only objects that don't own any other
+ * memory may live there, because dead young objects are never looked at.
+ *
+ * Allocating may run a minor collection, which moves young objects. Callers
+ * must not hold on to pointers to young objects the collector can't see.
+ */
+static Obj *allocateYoungObject(VM *vm, size_t size, ObjType type) {
+  Obj *object = (Obj *)allocateYoung(vm, size);
+  if (object == NULL) {
+    // Too big for the nursery.
+    return allocateObject(vm, size, type);
+  }
+
+  // Young objects use the link to the next object for the forwarding
+  // pointer once they are promoted.
+  object->header = (uint64_t)type << OBJ_TYPE_SHIFT;
   return object;
 }
 
@@ -31,55 +63,356 @@ ObjFunction *newFunction(VM *vm) {
 
   return function;
 }
-static ObjString *allocateString(VM *vm, char *chars, int length,
-                                 uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+
+ObjNative *newNative(VM *vm, NativeFn function, int arity) {
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+  native->arity = arity;
+  native->function = function;
+  return native;
+}
+
+ObjList *newList(VM *vm) {
+  ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+ObjMap *newMap(VM *vm) {
+  ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+  initMapTable(&map->table);
+  return map;
+}
+
+ObjFloatArray *newFloatArray(VM *vm, int count) {
+  ObjFloatArray *array = (ObjFloatArray *)allocateYoungObject(
+      vm, sizeof(ObjFloatArray) + sizeof(double) * count, OBJ_FLOAT_ARRAY);
+  array->count = count;
+  memset(array->values, 0, sizeof(double) * count);
+  return array;
+}
+
+uint32_t prepareMapKey(VM *vm, Value *key) {
+  if (IS_ROPE(*key)) {
+    *key = OBJ_VAL(flattenRope(vm, AS_ROPE(*key)));
+  }
+
+  switch (key->type) {
+  case VAL_NIL:
+    return hashWord(0);
+  case VAL_BOOL:
+    return hashWord(AS_BOOL(*key) ? 2 : 1);
+  case VAL_NUMBER: {
+    double number = key->as.number;
+    if (isnan(number)) {
+      throwRuntimeError(vm, "Map key can't be NaN.");
+    }
+    // Also turns -0 into 0, which equals it.
+    if (number >= INT32_MIN && number <= INT32_MAX &&
+        number == (int32_t)number) {
+      *key = INT_VAL((int32_t)number);
+      return hashWord((uint32_t)AS_INT(*key));
+    }
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashWord(bits);
+  }
+  case VAL_INT:
+    return hashWord((uint32_t)AS_INT(*key));
+  case VAL_SHORT_STRING:
+    return hashWord(key->as.shortString);
+  case VAL_OBJ:
+    if (IS_STRING(*key)) {
+      return stringHash(AS_STRING(*key));
+    }
+    break;
+  }
+
+  throwRuntimeError(vm, "Map key must be a string, number, boolean or nil.");
+}
+
+static void initString(ObjString *string, int length, uint32_t hash) {
   string->length = length;
-  string->chars = chars;
   string->hash = hash;
+  string->isInterned = false;
+  string->chars[length] = '\0';
+}
+
+/**
+ * Allocate an old string with room for length characters, for the caller to
+ * fill in.
+ */
+static ObjString *allocateString(VM *vm, int length, uint32_t hash) {
+  ObjString *string = (ObjString *)allocateObject(
+      vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+  initString(string, length, hash);
+  return string;
+}
 
-  // String interning
-  tableSet(&vm->strings, string, NIL_VAL);
+static ObjString *intern(VM *vm, ObjString *string) {
+  // vm->strings doesn't keep its strings alive, so keep the string on the
+  // stack in case growing the set triggers a collection.
+  push(vm, OBJ_VAL(string));
+  stringSetAdd(vm, &vm->strings, string);
+  string = AS_STRING(pop(vm));
+  // Only once it's really in the set, in case growing it ran out of memory.
+  string->isInterned = true;
+  return string;
+}
 
+/**
+ * Return the process-wide string with these characters, and keep it in
+ * vm->strings so finding it next time doesn't touch the shared interner.
+ */
+static ObjString *internShared(VM *vm, const char *chars, int length,
+                               uint32_t hash) {
+  // Shared strings are never freed, so this one needs no protecting while
+  // the set grows.
+  ObjString *string = sharedString(chars, length, hash);
+  stringSetAdd(vm, &vm->strings, string);
   return string;
 }
 
-static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
+ObjString *takeString(VM *vm, char *chars, int length) {
+  uint32_t hash = hashBytes(chars, length);
+  ObjString *interned = stringSetFind(&vm->strings, chars, length, hash);
+
+  if (interned != NULL) {
+    FREE_ARRAY(vm, char, chars, length + 1);
+    shadeValue(vm, OBJ_VAL(interned));
+    return interned;
+  }
 
-  for (int i = 0; i < length; i++) {
-    hash ^= key[i];
-    hash *= 16777619;
+  if (vm->sharedStrings) {
+    interned = internShared(vm, chars, length, hash);
+    FREE_ARRAY(vm, char, chars, length + 1);
+    return interned;
   }
 
-  return hash;
+  ObjString *string = allocateString(vm, length, hash);
+  memcpy(string->chars, chars, length);
+  FREE_ARRAY(vm, char, chars, length + 1);
+  return intern(vm, string);
 }
 
-ObjString *takeString(VM *vm, char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+ObjString *copyString(VM *vm, const char *chars, int length) {
+  return copyStringHashed(vm, chars, length, hashBytes(chars, length));
+}
+
+ObjString *copyStringHashed(VM *vm, const char *chars, int length,
+                            uint32_t hash) {
+  ObjString *interned = stringSetFind(&vm->strings, chars, length, hash);
 
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    // It may be white and only kept in the table because marking isn't done.
+    shadeValue(vm, OBJ_VAL(interned));
     return interned;
   }
 
-  return allocateString(vm, chars, length, hash);
+  if (vm->sharedStrings) {
+    return internShared(vm, chars, length, hash);
+  }
+
+  ObjString *string = allocateString(vm, length, hash);
+  memcpy(string->chars, chars, length);
+  return intern(vm, string);
 }
 
-ObjString *copyString(VM *vm, const char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+Value stringValue(VM *vm, const char *chars, int length) {
+  if (length <= SHORT_STRING_MAX) {
+    return shortStringVal(chars, length);
+  }
+  return OBJ_VAL(copyString(vm, chars, length));
+}
+
+ObjString *newStringBuffer(VM *vm, int length) {
+  ObjString *string = (ObjString *)allocateYoungObject(
+      vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+  initString(string, length, 0);
+  return string;
+}
 
+ObjString *internString(VM *vm, ObjString *string) {
+  if (string->isInterned) {
+    return string;
+  }
+
+  ObjString *interned = stringSetFind(&vm->strings, string->chars,
+                                      string->length, stringHash(string));
   if (interned != NULL) {
+    shadeValue(vm, OBJ_VAL(interned));
     return interned;
   }
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
+  if (vm->sharedStrings) {
+    return internShared(vm, string->chars, string->length, string->hash);
+  }
+
+  if (!isYoung(vm, (Obj *)string)) {
+    return intern(vm, string);
+  }
+
+  // Interned strings mustn't move, so intern an old copy instead.
+  int length = string->length;
+  uint32_t hash = string->hash;
+  push(vm, OBJ_VAL(string));
+  ObjString *copy = allocateString(vm, length, hash);
+  string = AS_STRING(pop(vm));
+  memcpy(copy->chars, string->chars, length);
+
+  return intern(vm, copy);
+}
+
+uint32_t stringHash(ObjString *string) {
+  // A string that really hashes to 0 just gets rehashed every time.
+  if (string->hash == 0) {
+    string->hash = hashBytes(string->chars, string->length);
+  }
+  return string->hash;
+}
+
+bool stringsEqual(ObjString *a, ObjString *b) {
+  if (a == b) {
+    return true;
+  }
+  if (a->isInterned && b->isInterned) {
+    return false;
+  }
+
+  return a->length == b->length && stringHash(a) == stringHash(b) &&
+         memcmp(a->chars, b->chars, a->length) == 0;
+}
 
-  return allocateString(vm, heapChars, length, hash);
+int stringLength(Obj *string) {
+  return objType(string) == OBJ_ROPE ? ((ObjRope *)string)->length
+                                  : ((ObjString *)string)->length;
+}
+
+ObjRope *newRope(VM *vm, Obj *left, Obj *right) {
+  // A rope that has been flattened is just its string now.
+  if (objType(left) == OBJ_ROPE && ((ObjRope *)left)->flat != NULL) {
+    left = (Obj *)((ObjRope *)left)->flat;
+  }
+  if (objType(right) == OBJ_ROPE && ((ObjRope *)right)->flat != NULL) {
+    right = (Obj *)((ObjRope *)right)->flat;
+  }
+
+  // Allocating may move the children, so keep them where the collector can
+  // update them.
+  push(vm, OBJ_VAL(left));
+  push(vm, OBJ_VAL(right));
+  ObjRope *rope = ALLOCATE_YOUNG_OBJ(vm, ObjRope, OBJ_ROPE);
+  right = AS_OBJ(pop(vm));
+  left = AS_OBJ(pop(vm));
+
+  rope->length = stringLength(left) + stringLength(right);
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+
+  return rope;
+}
+
+/**
+ * Return a pending stack with twice capacity's room, copied from pending,
+ * which is freed unless it is the caller's initial array.
+ */
+static Obj **growPending(Obj **pending, Obj **initial, int capacity) {
+  Obj **grown = malloc(sizeof(Obj *) * capacity * 2);
+  if (grown == NULL) {
+    fprintf(stderr, "malloc failed.\n");
+    exit(1);
+  }
+  memcpy(grown, pending, sizeof(Obj *) * capacity);
+  if (pending != initial) {
+    free(pending);
+  }
+  return grown;
+}
+
+/**
+ * Copy the characters of an unflattened rope into dest, which must have room
+ * for rope->length bytes.
+ *
+ * We fill dest from the end, following right children and leaving left ones
+ * for later. A string built by appending in a loop leans left, so only one
+ * node is ever pending for it, and the stack of pending nodes starts small.
+ * It grows with malloc rather than in the VM's heap, since a collection now
+ * could move the nodes.
+ */
+static void copyRopeChars(ObjRope *rope, char *dest) {
+  Obj *initial[ROPE_PENDING_INITIAL];
+  Obj **pending = initial;
+  int pendingCapacity = ROPE_PENDING_INITIAL;
+  int pendingCount = 0;
+  int end = rope->length;
+  Obj *node = (Obj *)rope;
+
+  while (true) {
+    if (objType(node) == OBJ_ROPE && ((ObjRope *)node)->flat != NULL) {
+      node = (Obj *)((ObjRope *)node)->flat;
+    }
+
+    if (objType(node) == OBJ_ROPE) {
+      if (pendingCount == pendingCapacity) {
+        pending = growPending(pending, initial, pendingCapacity);
+        pendingCapacity *= 2;
+      }
+      pending[pendingCount++] = ((ObjRope *)node)->left;
+      node = ((ObjRope *)node)->right;
+      continue;
+    }
+
+    ObjString *string = (ObjString *)node;
+    end -= string->length;
+    memcpy(dest + end, string->chars, string->length);
+
+    if (pendingCount == 0) {
+      break;
+    }
+    node = pending[--pendingCount];
+  }
+
+  if (pending != initial) {
+    free(pending);
+  }
+}
+
+ObjString *flattenRope(VM *vm, ObjRope *rope) {
+  if (rope->flat != NULL) {
+    return rope->flat;
+  }
+
+  int length = rope->length;
+  push(vm, OBJ_VAL(rope));
+  ObjString *flat = newStringBuffer(vm, length);
+  rope = AS_ROPE(pop(vm));
+
+  copyRopeChars(rope, flat->chars);
+
+  rope->flat = flat;
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier(vm, (Obj *)rope, OBJ_VAL(flat));
+  return rope->flat;
+}
+
+static void printRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+
+  // Printing has no VM to flatten with, whether it's the debug tracer or a
+  // list or map holding the rope, so use a scratch copy that isn't part of
+  // the VM's heap.
+  char *chars = malloc(rope->length);
+  if (chars == NULL) {
+    fprintf(stderr, "malloc failed.\n");
+    exit(1);
+  }
+  copyRopeChars(rope, chars);
+  printf("%.*s", rope->length, chars);
+  free(chars);
 }
 
 static void printFunction(ObjFunction *function) {
@@ -90,12 +423,122 @@ static void printFunction(ObjFunction *function) {
   }
 }
 
+// The lists and maps being printed, so that one containing itself prints as
+// [...] or {...} instead of forever. Each printObject() call keeps its own,
+// since VMs on other threads may be printing too.
+typedef struct {
+  Obj *objects[PRINT_DEPTH_MAX];
+  int depth;
+} PrintState;
+
+static void printNested(Value value, PrintState *state);
+
+static bool startPrinting(PrintState *state, Obj *object) {
+  for (int i = 0; i < state->depth; i++) {
+    if (state->objects[i] == object) {
+      return false;
+    }
+  }
+  if (state->depth == PRINT_DEPTH_MAX) {
+    return false;
+  }
+
+  state->objects[state->depth++] = object;
+  return true;
+}
+
+static void printList(ObjList *list, PrintState *state) {
+  if (!startPrinting(state, (Obj *)list)) {
+    printf("[...]");
+    return;
+  }
+
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    printNested(list->items.values[i], state);
+  }
+  printf("]");
+  state->depth--;
+}
+
+static void printMap(ObjMap *map, PrintState *state) {
+  if (!startPrinting(state, (Obj *)map)) {
+    printf("{...}");
+    return;
+  }
+
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.entryCount; i++) {
+    MapEntry *entry = map->table.entries + i;
+    if (isRemovedEntry(entry)) {
+      continue;
+    }
+    if (!first) {
+      printf(", ");
+    }
+    first = false;
+    printNested(entry->key, state);
+    printf(": ");
+    printNested(entry->value, state);
+  }
+  printf("}");
+  state->depth--;
+}
+
+static void printFloatArray(ObjFloatArray *array) {
+  printf("[");
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    printValue(NUMBER_VAL(array->values[i]));
+  }
+  printf("]");
+}
+
+/**
+ * Print an element of a list or map, carrying along the containers already
+ * being printed.
+ */
+static void printNested(Value value, PrintState *state) {
+  if (IS_LIST(value)) {
+    printList(AS_LIST(value), state);
+  } else if (IS_MAP(value)) {
+    printMap(AS_MAP(value), state);
+  } else {
+    printValue(value);
+  }
+}
+
 void printObject(Value value) {
+  PrintState state;
+  state.depth = 0;
+
   switch (OBJ_TYPE(value)) {
   case OBJ_FUNCTION:
     printFunction(AS_FUNCTION(value));
     break;
+  case OBJ_NATIVE:
+    printf("<native fn>");
+    break;
+  case OBJ_LIST:
+    printList(AS_LIST(value), &state);
+    break;
+  case OBJ_MAP:
+    printMap(AS_MAP(value), &state);
+    break;
+  case OBJ_FLOAT_ARRAY:
+    printFloatArray(AS_FLOAT_ARRAY(value));
+    break;
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
+    break;
+  case OBJ_ROPE:
+    printRope(AS_ROPE(value));
+    break;
   }
-}
\ No newline at end of file
+}
@@ -3,26 +3,66 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
+#include <assert.h>
 #include <stdint.h>
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) objType(AS_OBJ(value))
 
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
 
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray *)AS_OBJ(value))
+
+// Concatenations shorter than this are copied right away instead of
+// becoming ropes.
+#define ROPE_MIN_LENGTH 32
+
+// Nodes a walk over a rope can leave pending before it needs a bigger stack.
+#define ROPE_PENDING_INITIAL 32
+
+// Lists and maps nested deeper than this print as [...] or {...}.
+#define PRINT_DEPTH_MAX 64
 
 typedef enum {
   OBJ_STRING,
+  OBJ_ROPE,
   OBJ_FUNCTION,
+  OBJ_NATIVE,
+  OBJ_LIST,
+  OBJ_MAP,
+  OBJ_FLOAT_ARRAY,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_FLOAT_ARRAY + 1)
+
+// An object header is a single word. The low 48 bits, which is as wide as
+// user-space pointers get with 4-level paging, link to the next object in its
+// list. The ObjType and the collector's flags live in the bits above.
+#define OBJ_NEXT_MASK (((uint64_t)1 << 48) - 1)
+#define OBJ_TYPE_SHIFT 48
+// The collector reached this object in the current mark phase.
+#define OBJ_MARKED ((uint64_t)1 << 56)
+// This old object is in vm->rememberedSet.
+#define OBJ_REMEMBERED ((uint64_t)1 << 57)
+
+_Static_assert(sizeof(void *) == 8, "Obj headers assume 64 bit pointers.");
+
 struct Obj {
-  ObjType type;
-  struct Obj *next;
+  uint64_t header;
 };
 
 typedef struct {
@@ -32,24 +72,171 @@ typedef struct {
   ObjString *name;
 } ObjFunction;
 
+/**
+ * A function implemented in C. args points at the argCount arguments on the
+ * stack, and argCount has already been checked against the arity. Errors
+ * are reported with throwRuntimeError().
+ */
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
+
+typedef struct {
+  Obj obj;
+  int arity;
+  NativeFn function;
+} ObjNative;
+
+/**
+ * A growable array of values. Lists own their buffer, so they are never
+ * allocated in the nursery, and storing into one needs a writeBarrier().
+ */
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+/**
+ * A hash map. Like lists, maps are never young and need a writeBarrier()
+ * when stored into.
+ */
+typedef struct {
+  Obj obj;
+  MapTable table;
+} ObjMap;
+
+/**
+ * A fixed-length array of unboxed doubles, which the bulk natives run over
+ * with SIMD kernels. The elements are in the same allocation as the header
+ * and hold no references, so unlike lists these can be young.
+ */
+typedef struct {
+  Obj obj;
+  int count;
+  double values[];
+} ObjFloatArray;
+
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
+  // Strings created at runtime aren't hashed until something needs it, and
+  // keep 0 here until then.
   uint32_t hash;
+  // Whether this is the one copy of these characters in vm->strings or the
+  // shared interner, in which case it equals another interned string only if
+  // it is the same one.
+  bool isInterned;
+  // NUL-terminated, in the same allocation as the header.
+  char chars[];
 };
 
-typedef struct VM VM;
+/**
+ * A string produced by concatenation whose characters haven't been copied
+ * into one buffer yet. Each child is either an ObjString or an ObjRope.
+ */
+typedef struct {
+  Obj obj;
+  int length;
+  Obj *left;
+  Obj *right;
+  // Set once the characters are needed, at which point the children are
+  // dropped.
+  ObjString *flat;
+} ObjRope;
 
 ObjFunction *newFunction(VM *vm);
+ObjNative *newNative(VM *vm, NativeFn function, int arity);
+ObjList *newList(VM *vm);
+ObjMap *newMap(VM *vm);
+/**
+ * Allocate an array of count zeros.
+ */
+ObjFloatArray *newFloatArray(VM *vm, int count);
+/**
+ * Get *key ready for use in a map and return its hash. A rope is flattened
+ * and a whole number becomes an int, so that equal keys look the same.
+ * Reports a runtime error if it can't be a key. Flattening allocates, so key
+ * must be somewhere the collector updates, such as the stack.
+ */
+uint32_t prepareMapKey(VM *vm, Value *key);
 
+/**
+ * Like copyString, but also frees chars, which must have been allocated with
+ * length + 1 bytes.
+ */
 ObjString *takeString(VM *vm, char *chars, int length);
 ObjString *copyString(VM *vm, const char *chars, int length);
+/**
+ * Like copyString, for callers that already know the hash of chars.
+ */
+ObjString *copyStringHashed(VM *vm, const char *chars, int length,
+                            uint32_t hash);
+/**
+ * Return a Lox string value with a copy of chars: a short string if it fits,
+ * otherwise an interned ObjString.
+ */
+Value stringValue(VM *vm, const char *chars, int length);
+/**
+ * Allocate an un-interned string with room for length characters, for the
+ * caller to fill in. For strings created at runtime, which are often printed
+ * once and then dropped, so this skips interning and usually allocates in
+ * the nursery.
+ */
+ObjString *newStringBuffer(VM *vm, int length);
+/**
+ * Return the interned string with the same characters, interning string
+ * itself if there isn't one yet. Strings must be interned before they are
+ * used as table keys.
+ */
+ObjString *internString(VM *vm, ObjString *string);
+uint32_t stringHash(ObjString *string);
+bool stringsEqual(ObjString *a, ObjString *b);
+
+/**
+ * Both arguments must be ObjStrings or ObjRopes.
+ */
+ObjRope *newRope(VM *vm, Obj *left, Obj *right);
+ObjString *flattenRope(VM *vm, ObjRope *rope);
+/**
+ * Length of an ObjString or ObjRope.
+ */
+int stringLength(Obj *string);
 
 void printObject(Value value);
 
+static inline ObjType objType(Obj *object) {
+  return (ObjType)((object->header >> OBJ_TYPE_SHIFT) & 0xff);
+}
+
+static inline Obj *objNext(Obj *object) {
+  return (Obj *)(uintptr_t)(object->header & OBJ_NEXT_MASK);
+}
+
+static inline void setObjNext(Obj *object, Obj *next) {
+  // Catches 5-level paging or tagged pointers, which would otherwise lose
+  // their top bits and corrupt the object list.
+  assert(((uintptr_t)next & ~OBJ_NEXT_MASK) == 0);
+  object->header = (object->header & ~OBJ_NEXT_MASK) | (uintptr_t)next;
+}
+
+static inline bool isMarked(Obj *object) {
+  return (object->header & OBJ_MARKED) != 0;
+}
+
+static inline void setMarked(Obj *object, bool marked) {
+  object->header = marked ? object->header | OBJ_MARKED
+                          : object->header & ~OBJ_MARKED;
+}
+
+static inline bool isRemembered(Obj *object) {
+  return (object->header & OBJ_REMEMBERED) != 0;
+}
+
+static inline void setRemembered(Obj *object, bool remembered) {
+  object->header = remembered ? object->header | OBJ_REMEMBERED
+                              : object->header & ~OBJ_REMEMBERED;
+}
+
 static inline bool isObjType(Value value, ObjType type) {
-  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+  return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
 #endif
\ No newline at end of file
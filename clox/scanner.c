@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "hash.h"
 #include "scanner.h"
 
 void initScanner(Scanner *scanner, const char *source) {
@@ -16,7 +17,8 @@ static Token makeToken(Scanner *scanner, TokenType type) {
   Token token = {.type = type,
                  .start = scanner->start,
                  .length = (int)(scanner->current - scanner->start),
-                 .line = scanner->line};
+                 .line = scanner->line,
+                 .hash = 0};
 
   return token;
 }
@@ -25,7 +27,8 @@ static Token makeErrorToken(Scanner *scanner, const char *message) {
   Token token = {.type = TOKEN_ERROR,
                  .start = scanner->start,
                  .length = (int)strlen(message),
-                 .line = scanner->line};
+                 .line = scanner->line,
+                 .hash = 0};
   return token;
 }
 
@@ -78,8 +81,8 @@ static Token string(Scanner *scanner) {
   while (peek(scanner) != '"' && !isAtEnd(scanner)) {
     if (peek(scanner) == '\n') {
       scanner->line++;
-      advance(scanner);
     }
+    advance(scanner);
   }
 
   if (isAtEnd(scanner)) {
@@ -192,7 +195,14 @@ static Token identifier(Scanner *scanner) {
     advance(scanner);
   }
 
-  return makeToken(scanner, identifierType(scanner));
+  // Hash while the characters are in cache anyway, so that the compiler can
+  // compare names and intern them without hashing them again. Keywords are
+  // never looked up by name, so they don't need a hash.
+  Token token = makeToken(scanner, identifierType(scanner));
+  if (token.type == TOKEN_IDENTIFIER) {
+    token.hash = hashBytes(token.start, token.length);
+  }
+  return token;
 }
 
 Token scanToken(Scanner *scanner) {
@@ -224,6 +234,12 @@ Token scanToken(Scanner *scanner) {
     return makeToken(scanner, TOKEN_LEFT_BRACE);
   case '}':
     return makeToken(scanner, TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(scanner, TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+  case ':':
+    return makeToken(scanner, TOKEN_COLON);
   case ';':
     return makeToken(scanner, TOKEN_SEMICOLON);
   case ',':
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef struct {
   const char *start;
   const char *current;
@@ -13,6 +15,9 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -63,6 +68,8 @@ typedef struct {
   const char *start;
   int length;
   int line;
+  // Hash of the lexeme, only computed for identifiers.
+  uint32_t hash;
 } Token;
 
 void initScanner(Scanner *scanner, const char *source);
@@ -2,73 +2,231 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+// Tables this empty are rebuilt smaller.
+#define TABLE_MIN_LOAD 0.125
+
+// Control bytes of slots without a key. Both have the top bit set, which
+// the low 7 bits of a hash never do.
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
 
 void initTable(Table *table) {
   table->count = 0;
+  table->deleted = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->control = NULL;
 }
 
-void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM *vm, Table *table) {
+  FREE_ARRAY(vm, uint8_t, table->entries, tableBytes(table->capacity));
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
+// The control byte for a key picks out likely slots in a group, while the
+// rest of the hash picks the slot to start probing at.
+static uint8_t hashTag(uint32_t hash) { return hash & 0x7f; }
+
+static uint32_t homeSlot(int capacity, uint32_t hash) {
+  return (hash >> 7) & (capacity - 1);
+}
+
+/**
+ * Return where to probe after slot. Stepping a group further each time
+ * visits every group, since the number of groups is a power of two.
+ */
+static uint32_t nextProbe(int capacity, uint32_t slot, uint32_t *step) {
+  *step += TABLE_GROUP_SIZE;
+  return (slot + *step) & (capacity - 1);
+}
+
+/**
+ * Set the control byte of slot, and its copy past the end that lets a group
+ * starting near the end be read in one go.
+ */
+static void setControl(uint8_t *control, int capacity, int slot,
+                       uint8_t byte) {
+  control[slot] = byte;
+  if (slot < TABLE_GROUP_SIZE) {
+    control[capacity + slot] = byte;
+  }
+}
+
+#ifndef __SSE2__
+// Without SSE2, groups are read as two words and every byte tested at once.
+#define BYTES_LOW 0x0101010101010101ull
+#define BYTES_HIGH 0x8080808080808080ull
+
+/**
+ * Read the 8 control bytes at control as a word with the first in the lowest
+ * byte, whatever the byte order.
+ */
+static uint64_t loadWord(const uint8_t *control) {
+  uint64_t word = 0;
+  for (int i = 0; i < 8; i++) {
+    word |= (uint64_t)control[i] << (8 * i);
+  }
+  return word;
+}
+
+/**
+ * Gather the top bit of each byte of a word into an 8 bit mask.
+ */
+static uint32_t packHighBits(uint64_t word) {
+  return (uint32_t)((((word & BYTES_HIGH) >> 7) * 0x0102040810204080ull) >>
+                    56);
+}
+
+/**
+ * Return a mask of the bytes of word that are 0. Unlike the usual
+ * (x - 1) & ~x test, this has no false positives.
+ */
+static uint32_t zeroBytes(uint64_t word) {
+  uint64_t low = (word & ~BYTES_HIGH) + ~BYTES_HIGH;
+  return packHighBits(~(low | word | ~BYTES_HIGH));
+}
+#endif
+
+/**
+ * Return a mask of the slots in the group starting at control whose control
+ * byte is tag.
+ */
+static uint32_t matchTag(const uint8_t *control, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *)control);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+  uint64_t tags = BYTES_LOW * tag;
+  return zeroBytes(loadWord(control) ^ tags) |
+         zeroBytes(loadWord(control + 8) ^ tags) << 8;
+#endif
+}
+
+/**
+ * Return a mask of the slots in the group starting at control that don't hold
+ * a key.
+ */
+static uint32_t matchFree(const uint8_t *control) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)control));
+#else
+  return packHighBits(loadWord(control)) |
+         packHighBits(loadWord(control + 8)) << 8;
+#endif
+}
+
+/**
+ * Return the slot holding key, or the slot it should be added in if it isn't
+ * in the table.
+ */
+static int findEntry(Table *table, ObjString *key) {
+  uint32_t hash = key->hash;
+  uint32_t slot = homeSlot(table->capacity, hash);
+
+  // Most keys sit in the slot they hash to, and checking it directly saves
+  // waiting on the control bytes.
+  if (table->entries[slot].key == key) {
+    return slot;
+  }
+
+  uint8_t tag = hashTag(hash);
+  uint32_t step = 0;
+  int freeSlot = -1;
 
   while (true) {
-    Entry *entry = entries + index;
+    const uint8_t *control = table->control + slot;
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // tombstone
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+    for (uint32_t match = matchTag(control, tag); match != 0;
+         match &= match - 1) {
+      int index = (slot + __builtin_ctz(match)) & (table->capacity - 1);
+      if (table->entries[index].key == key) {
+        return index;
       }
-    } else if (entry->key == key) {
-      return entry;
     }
 
-    index = (index + 1) % capacity;
+    uint32_t freeMask = matchFree(control);
+    if (freeSlot == -1 && freeMask != 0) {
+      // Reuse the first deleted slot on the way, if there is one.
+      freeSlot = (slot + __builtin_ctz(freeMask)) & (table->capacity - 1);
+    }
+    // A group with an empty slot ends every probe sequence through it.
+    if (matchTag(control, TABLE_EMPTY) != 0) {
+      return freeSlot;
+    }
+
+    slot = nextProbe(table->capacity, slot, &step);
   }
 }
 
-static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
+/**
+ * Return the capacity to rebuild a table holding count keys with, which
+ * leaves it at most half full.
+ */
+static int capacityFor(int count) {
+  int capacity = TABLE_GROUP_SIZE;
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static bool shouldShrink(int count, int capacity) {
+  return capacity > TABLE_GROUP_SIZE && count < capacity * TABLE_MIN_LOAD;
+}
+
+/**
+ * Return whether count keys and deleted slots leave no room for one more in
+ * capacity slots, or so much that the table should shrink.
+ */
+static bool shouldRebuild(int count, int deleted, int capacity) {
+  return count + deleted + 1 > capacity * TABLE_MAX_LOAD ||
+         shouldShrink(count, capacity);
+}
+
+/**
+ * Move the entries into a new array of capacity slots, which also gets rid
+ * of every deleted slot.
+ */
+static void adjustCapacity(VM *vm, Table *table, int capacity) {
+  Table resized;
+  resized.count = 0;
+  resized.deleted = 0;
+  resized.capacity = capacity;
+  resized.entries = (Entry *)ALLOCATE(vm, uint8_t, tableBytes(capacity));
+  resized.control = (uint8_t *)(resized.entries + capacity);
 
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    resized.entries[i].key = NULL;
+    resized.entries[i].value = NIL_VAL;
   }
+  memset(resized.control, TABLE_EMPTY, capacity + TABLE_GROUP_SIZE);
 
-  table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = table->entries + i;
     if (entry->key == NULL) {
       continue;
     }
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    int slot = findEntry(&resized, entry->key);
+    resized.entries[slot] = *entry;
+    setControl(resized.control, resized.capacity, slot, hashTag(entry->key->hash));
+    resized.count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-
-  table->entries = entries;
-  table->capacity = capacity;
+  FREE_ARRAY(vm, uint8_t, table->entries, tableBytes(table->capacity));
+  *table = resized;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
@@ -76,7 +234,7 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
     return false;
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  Entry *entry = table->entries + findEntry(table, key);
   if (entry->key == NULL) {
     return false;
   }
@@ -85,69 +243,409 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
   return true;
 }
 
-bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value) {
+  // Deleted slots fill the table up as much as keys do. Rebuilding for the
+  // keys alone clears them, and shrinks the table if the collector emptied
+  // it.
+  if (shouldRebuild(table->count, table->deleted, table->capacity)) {
+    adjustCapacity(vm, table, capacityFor(table->count + 1));
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  int slot = findEntry(table, key);
+  Entry *entry = table->entries + slot;
 
   bool isNewKey = entry->key == NULL;
-  // We don't count tombstones as empty buckets.
-  if (isNewKey && IS_NIL(entry->value)) {
+  if (isNewKey) {
     table->count++;
+    if (table->control[slot] == TABLE_DELETED) {
+      table->deleted--;
+    }
   }
 
   entry->key = key;
   entry->value = value;
+  setControl(table->control, table->capacity, slot, hashTag(key->hash));
   return isNewKey;
 }
 
-void tableAddAll(Table *from, Table *to) {
+void tableAddAll(VM *vm, Table *from, Table *to) {
   for (int i = 0; i < from->capacity; i++) {
     Entry *entry = from->entries + i;
     if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+      tableSet(vm, to, entry->key, entry->value);
     }
   }
 }
-ObjString *tableFindString(Table *table, const char *chars, int length,
-                           uint32_t hash) {
+/**
+ * Return whether a free slot can be made empty rather than deleted. A probe
+ * only goes past a group with no empty slots, so if every group holding the
+ * slot has one, no probe has gone past it.
+ */
+static bool canEmpty(const uint8_t *control, int capacity, int slot) {
+  uint32_t emptyBefore =
+      matchTag(control + ((slot - TABLE_GROUP_SIZE) & (capacity - 1)),
+               TABLE_EMPTY);
+  uint32_t emptyAfter = matchTag(control + slot, TABLE_EMPTY);
+  // Count the keys between the empty slots closest to this one on either
+  // side.
+  return emptyBefore != 0 && emptyAfter != 0 &&
+         __builtin_ctz(emptyAfter) + __builtin_clz(emptyBefore << 16) <
+             TABLE_GROUP_SIZE;
+}
+
+static void deleteSlot(Table *table, int slot) {
+  table->entries[slot].key = NULL;
+  table->entries[slot].value = NIL_VAL;
+  table->count--;
+
+  if (canEmpty(table->control, table->capacity, slot)) {
+    setControl(table->control, table->capacity, slot, TABLE_EMPTY);
+    return;
+  }
+
+  setControl(table->control, table->capacity, slot, TABLE_DELETED);
+  table->deleted++;
+}
+
+bool tableDelete(VM *vm, Table *table, ObjString *key) {
   if (table->count == 0) {
+    return false;
+  }
+
+  int slot = findEntry(table, key);
+  if (table->entries[slot].key == NULL) {
+    return false;
+  }
+
+  deleteSlot(table, slot);
+  if (shouldShrink(table->count, table->capacity)) {
+    adjustCapacity(vm, table, capacityFor(table->count));
+  }
+  return true;
+}
+
+void markTable(VM *vm, Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = table->entries + i;
+    markObject(vm, (Obj *)entry->key);
+    markValue(vm, entry->value);
+  }
+}
+
+void initStringSet(StringSet *set) {
+  set->count = 0;
+  set->deleted = 0;
+  set->capacity = 0;
+  set->keys = NULL;
+  set->hashes = NULL;
+  set->control = NULL;
+}
+
+void freeStringSet(VM *vm, StringSet *set) {
+  FREE_ARRAY(vm, uint8_t, set->keys, stringSetBytes(set->capacity));
+  initStringSet(set);
+}
+
+static bool isFull(uint8_t control) { return (control & 0x80) == 0; }
+
+ObjString *stringSetFind(StringSet *set, const char *chars, int length,
+                         uint32_t hash) {
+  if (set->count == 0) {
     return NULL;
   }
 
-  uint32_t index = hash % table->capacity;
+  uint8_t tag = hashTag(hash);
+  uint32_t slot = homeSlot(set->capacity, hash);
+  uint32_t step = 0;
 
   while (true) {
-    Entry *entry = table->entries + index;
+    const uint8_t *control = set->control + slot;
 
-    if (entry->key == NULL) {
-      // empty, not a tombstone
-      if (IS_NIL(entry->value)) {
-        return NULL;
+    for (uint32_t match = matchTag(control, tag); match != 0;
+         match &= match - 1) {
+      int index = (slot + __builtin_ctz(match)) & (set->capacity - 1);
+      // The whole hash rules out almost every other string without reading
+      // it.
+      if (set->hashes[index] != hash) {
+        continue;
       }
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+
+      ObjString *key = set->keys[index];
+      if (key->length == length && memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+    }
+
+    if (matchTag(control, TABLE_EMPTY) != 0) {
+      return NULL;
     }
 
-    index = (index + 1) % table->capacity;
+    slot = nextProbe(set->capacity, slot, &step);
   }
 }
-bool tableDelete(Table *table, ObjString *key) {
-  if (table->count == 0) {
-    return false;
+
+/**
+ * Return the first free slot in the probe sequence for hash, which is where
+ * a key with that hash goes.
+ */
+static int findFreeSlot(const uint8_t *control, int capacity, uint32_t hash) {
+  uint32_t slot = homeSlot(capacity, hash);
+  uint32_t step = 0;
+
+  while (true) {
+    uint32_t freeMask = matchFree(control + slot);
+    if (freeMask != 0) {
+      return (slot + __builtin_ctz(freeMask)) & (capacity - 1);
+    }
+
+    slot = nextProbe(capacity, slot, &step);
   }
+}
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+static void adjustSetCapacity(VM *vm, StringSet *set, int capacity) {
+  StringSet resized;
+  resized.count = set->count;
+  resized.deleted = 0;
+  resized.capacity = capacity;
+  resized.keys = (ObjString **)ALLOCATE(vm, uint8_t, stringSetBytes(capacity));
+  resized.hashes = (uint32_t *)(resized.keys + capacity);
+  resized.control = (uint8_t *)(resized.hashes + capacity);
+  memset(resized.control, TABLE_EMPTY, capacity + TABLE_GROUP_SIZE);
+
+  // Thanks to the saved hashes, this doesn't read any of the strings.
+  for (int i = 0; i < set->capacity; i++) {
+    if (!isFull(set->control[i])) {
+      continue;
+    }
+
+    uint32_t hash = set->hashes[i];
+    int slot = findFreeSlot(resized.control, capacity, hash);
+    resized.keys[slot] = set->keys[i];
+    resized.hashes[slot] = hash;
+    setControl(resized.control, capacity, slot, hashTag(hash));
+  }
+
+  FREE_ARRAY(vm, uint8_t, set->keys, stringSetBytes(set->capacity));
+  *set = resized;
+}
+
+void stringSetAdd(VM *vm, StringSet *set, ObjString *string) {
+  if (shouldRebuild(set->count, set->deleted, set->capacity)) {
+    adjustSetCapacity(vm, set, capacityFor(set->count + 1));
+  }
+
+  int slot = findFreeSlot(set->control, set->capacity, string->hash);
+  if (set->control[slot] == TABLE_DELETED) {
+    set->deleted--;
+  }
+
+  set->keys[slot] = string;
+  set->hashes[slot] = string->hash;
+  setControl(set->control, set->capacity, slot, hashTag(string->hash));
+  set->count++;
+}
+
+void stringSetRemoveWhite(StringSet *set) {
+  for (int i = 0; i < set->capacity; i++) {
+    if (!isFull(set->control[i]) || isMarked(&set->keys[i]->obj)) {
+      continue;
+    }
+
+    set->count--;
+    if (canEmpty(set->control, set->capacity, i)) {
+      setControl(set->control, set->capacity, i, TABLE_EMPTY);
+    } else {
+      setControl(set->control, set->capacity, i, TABLE_DELETED);
+      set->deleted++;
+    }
+  }
+}
+
+void initMapTable(MapTable *map) {
+  map->count = 0;
+  map->entryCount = 0;
+  map->entryCapacity = 0;
+  map->entries = NULL;
+  map->deleted = 0;
+  map->capacity = 0;
+  map->slots = NULL;
+  map->control = NULL;
+}
+
+static size_t mapIndexBytes(int capacity) {
+  return (sizeof(int32_t) + 1) * (size_t)capacity + TABLE_GROUP_SIZE;
+}
+
+void freeMapTable(VM *vm, MapTable *map) {
+  FREE_ARRAY(vm, MapEntry, map->entries, map->entryCapacity);
+  if (map->capacity > 0) {
+    FREE_ARRAY(vm, uint8_t, map->slots, mapIndexBytes(map->capacity));
+  }
+  initMapTable(map);
+}
+
+/**
+ * Return the index slot holding key, or -1 if it isn't in the map.
+ */
+static int findMapSlot(MapTable *map, Value key, uint32_t hash) {
+  if (map->count == 0) {
+    return -1;
+  }
+
+  uint32_t slot = homeSlot(map->capacity, hash);
+  uint8_t tag = hashTag(hash);
+  uint32_t step = 0;
+
+  while (true) {
+    const uint8_t *control = map->control + slot;
+
+    for (uint32_t match = matchTag(control, tag); match != 0;
+         match &= match - 1) {
+      int index = (slot + __builtin_ctz(match)) & (map->capacity - 1);
+      MapEntry *entry = map->entries + map->slots[index];
+      if (entry->hash == hash && valuesEqual(entry->key, key)) {
+        return index;
+      }
+    }
+
+    if (matchTag(control, TABLE_EMPTY) != 0) {
+      return -1;
+    }
+
+    slot = nextProbe(map->capacity, slot, &step);
+  }
+}
+
+int mapTableFind(MapTable *map, Value key, uint32_t hash) {
+  int slot = findMapSlot(map, key, hash);
+  return slot == -1 ? -1 : map->slots[slot];
+}
+
+/**
+ * Rebuild the index from the entries, which gets rid of its deleted slots.
+ */
+static void indexEntries(MapTable *map) {
+  memset(map->control, TABLE_EMPTY, map->capacity + TABLE_GROUP_SIZE);
+  map->deleted = 0;
+
+  for (int i = 0; i < map->entryCount; i++) {
+    MapEntry *entry = map->entries + i;
+    if (isRemovedEntry(entry)) {
+      continue;
+    }
+
+    int slot = findFreeSlot(map->control, map->capacity, entry->hash);
+    map->slots[slot] = i;
+    setControl(map->control, map->capacity, slot, hashTag(entry->hash));
+  }
+}
+
+/**
+ * Slide the remaining entries down over the removed ones, keeping their
+ * order. Positions change, so the index needs rebuilding after.
+ */
+static void compactEntries(MapTable *map) {
+  int count = 0;
+  for (int i = 0; i < map->entryCount; i++) {
+    if (!isRemovedEntry(map->entries + i)) {
+      map->entries[count++] = map->entries[i];
+    }
+  }
+  map->entryCount = count;
+}
+
+/**
+ * Replace the index with an uninitialized one of capacity slots, for the
+ * caller to fill with indexEntries().
+ */
+static void resizeIndex(VM *vm, MapTable *map, int capacity) {
+  int32_t *slots = (int32_t *)ALLOCATE(vm, uint8_t, mapIndexBytes(capacity));
+  if (map->capacity > 0) {
+    FREE_ARRAY(vm, uint8_t, map->slots, mapIndexBytes(map->capacity));
+  }
+  map->capacity = capacity;
+  map->slots = slots;
+  map->control = (uint8_t *)(slots + capacity);
+}
+
+void mapTableReserve(VM *vm, MapTable *map) {
+  // Allocate everything before moving any entry, so that a collection or
+  // heap limit error finds the entries where the index says they are.
+  bool compact = false;
+  if (map->entryCount == map->entryCapacity) {
+    if (map->entryCount - map->count > map->entryCount / 2) {
+      // Mostly removed entries, so reuse their space instead of growing.
+      compact = true;
+    } else {
+      int capacity = GROW_CAPACITY(map->entryCapacity);
+      map->entries = GROW_ARRAY(vm, MapEntry, map->entries,
+                                map->entryCapacity, capacity);
+      map->entryCapacity = capacity;
+    }
+  }
+
+  bool rebuild = shouldRebuild(map->count, map->deleted, map->capacity);
+  if (rebuild) {
+    resizeIndex(vm, map, capacityFor(map->count + 1));
+  }
+
+  if (compact) {
+    compactEntries(map);
+  }
+  if (compact || rebuild) {
+    indexEntries(map);
+  }
+}
+
+int mapTableSet(MapTable *map, Value key, uint32_t hash, Value value) {
+  int slot = findMapSlot(map, key, hash);
+  if (slot != -1) {
+    map->entries[map->slots[slot]].value = value;
+    return map->slots[slot];
+  }
+
+  slot = findFreeSlot(map->control, map->capacity, hash);
+  if (map->control[slot] == TABLE_DELETED) {
+    map->deleted--;
+  }
+
+  int position = map->entryCount++;
+  map->entries[position].key = key;
+  map->entries[position].value = value;
+  map->entries[position].hash = hash;
+  map->slots[slot] = position;
+  setControl(map->control, map->capacity, slot, hashTag(hash));
+  map->count++;
+  return position;
+}
+
+bool mapTableRemove(VM *vm, MapTable *map, Value key, uint32_t hash) {
+  int slot = findMapSlot(map, key, hash);
+  if (slot == -1) {
     return false;
   }
 
-  // tombstone
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  MapEntry *entry = map->entries + map->slots[slot];
+  entry->key = OBJ_VAL(NULL);
+  entry->value = NIL_VAL;
+  map->count--;
+
+  if (canEmpty(map->control, map->capacity, slot)) {
+    setControl(map->control, map->capacity, slot, TABLE_EMPTY);
+  } else {
+    setControl(map->control, map->capacity, slot, TABLE_DELETED);
+    map->deleted++;
+  }
 
+  if (shouldShrink(map->count, map->capacity)) {
+    // Allocate first, so that a collection or heap limit error finds the
+    // entries where the old index says they are.
+    resizeIndex(vm, map, capacityFor(map->count));
+    compactEntries(map);
+    int entryCapacity = map->capacity / 2;
+    map->entries = GROW_ARRAY(vm, MapEntry, map->entries, map->entryCapacity,
+                              entryCapacity);
+    map->entryCapacity = entryCapacity;
+    indexEntries(map);
+  }
   return true;
 }
@@ -10,23 +10,152 @@ typedef struct {
   Value value;
 } Entry;
 
+// Slots are probed in groups of this many, one control byte for each.
+#define TABLE_GROUP_SIZE 16
+
 typedef struct {
-  // Load factor = count / capacity
+  // Keys in the table. Load factor = (count + deleted) / capacity
   int count;
+  // Slots whose key was deleted but that probes must still go past.
+  int deleted;
+  // Zero or a power of two no smaller than TABLE_GROUP_SIZE.
   int capacity;
+  // Empty and deleted slots have a NULL key and a nil value.
   Entry *entries;
+  // For each slot, TABLE_EMPTY, TABLE_DELETED, or the low 7 bits of its
+  // key's hash, followed by a copy of the first TABLE_GROUP_SIZE. Lives in
+  // the same block as entries, right after them.
+  uint8_t *control;
 } Table;
 
+// A set of interned strings, which are looked up by their characters. It
+// keeps each string's hash next to it, so that lookups and rebuilds rarely
+// have to read a string, and has no values.
+typedef struct {
+  // Like the fields of Table.
+  int count;
+  int deleted;
+  int capacity;
+  // One of each for every slot, followed by the control bytes, all in one
+  // block. Keys and hashes of free slots are garbage.
+  ObjString **keys;
+  uint32_t *hashes;
+  uint8_t *control;
+} StringSet;
+
+typedef struct {
+  Value key;
+  Value value;
+  // Kept so that reindexing never rehashes keys.
+  uint32_t hash;
+} MapEntry;
+
+// A table keyed by nil, booleans, numbers and strings that remembers the
+// order its keys were added in. Entries are kept in that order in a dense
+// array, and an index like a Table's, with a position in the array for each
+// slot, finds them by hash.
+typedef struct {
+  // Keys in the table.
+  int count;
+  // Entries in use, including removed ones, which have a NULL object for a
+  // key and a nil value until the array is compacted.
+  int entryCount;
+  int entryCapacity;
+  MapEntry *entries;
+  // Like the fields of Table, for the index.
+  int deleted;
+  int capacity;
+  // The position in entries of each slot's key, followed by the control
+  // bytes in the same block.
+  int32_t *slots;
+  uint8_t *control;
+} MapTable;
+
 void initTable(Table *table);
-void freeTable(Table *table);
+void freeTable(VM *vm, Table *table);
+
+/**
+ * The number of bytes a table with capacity slots allocates.
+ */
+static inline size_t tableBytes(int capacity) {
+  if (capacity == 0) {
+    return 0;
+  }
+  return (sizeof(Entry) + 1) * (size_t)capacity + TABLE_GROUP_SIZE;
+}
 
 bool tableGet(Table *table, ObjString *key, Value *value);
 /**
  * Return true if the key did not already exist in the table.
  */
-bool tableSet(Table *table, ObjString *key, Value value);
-void tableAddAll(Table *from, Table *to);
-ObjString *tableFindString(Table *table, const char *chars, int length,
-                           uint32_t hash);
-bool tableDelete(Table *table, ObjString *key);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value);
+void tableAddAll(VM *vm, Table *from, Table *to);
+/**
+ * Delete key from the table, shrinking it if it has become mostly empty.
+ */
+bool tableDelete(VM *vm, Table *table, ObjString *key);
+void markTable(VM *vm, Table *table);
+
+void initStringSet(StringSet *set);
+void freeStringSet(VM *vm, StringSet *set);
+
+static inline size_t stringSetBytes(int capacity) {
+  if (capacity == 0) {
+    return 0;
+  }
+  return (sizeof(ObjString *) + sizeof(uint32_t) + 1) * (size_t)capacity +
+         TABLE_GROUP_SIZE;
+}
+
+ObjString *stringSetFind(StringSet *set, const char *chars, int length,
+                         uint32_t hash);
+/**
+ * Add a string that isn't in the set yet.
+ */
+void stringSetAdd(VM *vm, StringSet *set, ObjString *string);
+/**
+ * Remove every string the collector's mark phase didn't reach. Doesn't
+ * allocate, so the set only shrinks on the next stringSetAdd.
+ */
+void stringSetRemoveWhite(StringSet *set);
+
+void initMapTable(MapTable *map);
+void freeMapTable(VM *vm, MapTable *map);
+
+static inline bool isRemovedEntry(MapEntry *entry) {
+  return IS_OBJ(entry->key) && AS_OBJ(entry->key) == NULL;
+}
+
+/**
+ * The number of bytes the entries and index of a map table allocate.
+ */
+static inline size_t mapTableBytes(MapTable *map) {
+  size_t bytes = sizeof(MapEntry) * (size_t)map->entryCapacity;
+  if (map->capacity > 0) {
+    bytes += (sizeof(int32_t) + 1) * (size_t)map->capacity + TABLE_GROUP_SIZE;
+  }
+  return bytes;
+}
+
+/**
+ * Return the position in map->entries of key, or -1 if it isn't in the map.
+ * Keys must be prepared with prepareMapKey().
+ */
+int mapTableFind(MapTable *map, Value key, uint32_t hash);
+/**
+ * Make room for one more key, so that the next mapTableSet() doesn't
+ * allocate.
+ */
+void mapTableReserve(VM *vm, MapTable *map);
+/**
+ * Set key to value and return the position of its entry. Never allocates, so
+ * a new key needs mapTableReserve() first.
+ */
+int mapTableSet(MapTable *map, Value key, uint32_t hash, Value value);
+/**
+ * Remove key from the map. The entry is reclaimed when the entries are next
+ * compacted, which happens here once so few keys are left that the map
+ * shrinks.
+ */
+bool mapTableRemove(VM *vm, MapTable *map, Value key, uint32_t hash);
 #endif
\ No newline at end of file
@@ -12,20 +12,29 @@ void initValueArray(ValueArray *array) {
   array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value) {
-  if (array->capacity < array->count + 1) {
-    int oldCapacity = array->capacity;
-    array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values =
-        GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
-  }
+void writeValueArray(VM *vm, ValueArray *array, Value value) {
+  reserveValueArray(vm, array, array->count + 1);
 
   array->values[array->count] = value;
   array->count++;
 }
 
-void freeValueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void reserveValueArray(VM *vm, ValueArray *array, int count) {
+  if (array->capacity >= count) {
+    return;
+  }
+
+  int oldCapacity = array->capacity;
+  int capacity = oldCapacity;
+  while (capacity < count) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, capacity);
+  array->capacity = capacity;
+}
+
+void freeValueArray(VM *vm, ValueArray *array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
@@ -38,8 +47,14 @@ void printValue(Value value) {
     printf("nil");
     break;
   case VAL_NUMBER:
+  case VAL_INT:
     printf("%g", AS_NUMBER(value));
     break;
+  case VAL_SHORT_STRING: {
+    char chars[SHORT_STRING_MAX];
+    printf("%.*s", shortStringChars(value, chars), chars);
+    break;
+  }
   case VAL_OBJ:
     printObject(value);
     break;
@@ -47,6 +62,11 @@ void printValue(Value value) {
 }
 
 bool valuesEqual(Value a, Value b) {
+  // An int and a double holding the same number are the same Lox value.
+  if (IS_NUMBER(a) && IS_NUMBER(b) && a.type != b.type) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+
   if (a.type != b.type) {
     return false;
   }
@@ -58,7 +78,14 @@ bool valuesEqual(Value a, Value b) {
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
+  case VAL_INT:
+    return AS_INT(a) == AS_INT(b);
+  case VAL_SHORT_STRING:
+    return a.as.shortString == b.as.shortString;
   case VAL_OBJ: {
+    if (IS_STRING(a) && IS_STRING(b)) {
+      return stringsEqual(AS_STRING(a), AS_STRING(b));
+    }
     return AS_OBJ(a) == AS_OBJ(b);
   }
   default:
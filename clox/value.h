@@ -5,20 +5,32 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct VM VM;
 
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
+  VAL_INT, // Integral numbers that fit in 32 bits, e.g. loop counters
+  // Strings of up to SHORT_STRING_MAX bytes, stored in the value itself.
+  // Every string that short is one of these, never an ObjString.
+  VAL_SHORT_STRING,
   VAL_OBJ // Values that live on the heap
 } ValueType;
 
+#define SHORT_STRING_MAX 7
+
 typedef struct {
   ValueType type;
 
   union {
     bool boolean;
     double number;
+    int32_t integer;
+    // Character i in bits 8 * i and up, the length in the top byte, and
+    // zeros in between, so equal strings have equal bits. Not a char array,
+    // which would keep the compiler from holding values in registers.
+    uint64_t shortString;
     Obj *obj;
   } as;
 } Value;
@@ -26,20 +38,58 @@ typedef struct {
 // tyPe sAFETy
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+// Both doubles and ints are Lox numbers; IS_INT only selects the fast path.
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_SHORT_STRING(value) ((value).type == VAL_SHORT_STRING)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 // Macros to convert a native C value to a clox tagged union
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)value}})
 
 // Macros to extract a native c value from a clox union
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_NUMBER(value) valueToNumber(value)
+#define AS_INT(value) ((value).as.integer)
 #define AS_OBJ(value) ((value).as.obj)
 
+/**
+ * Read a number as a double, whichever representation it is stored in.
+ */
+static inline double valueToNumber(Value value) {
+  return value.type == VAL_INT ? (double)value.as.integer : value.as.number;
+}
+
+/**
+ * Make a short string value. length must be at most SHORT_STRING_MAX.
+ */
+static inline Value shortStringVal(const char *chars, int length) {
+  uint64_t bits = (uint64_t)length << 56;
+  for (int i = 0; i < length; i++) {
+    bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+  }
+  return (Value){VAL_SHORT_STRING, {.shortString = bits}};
+}
+
+static inline int shortStringLength(Value value) {
+  return (int)(value.as.shortString >> 56);
+}
+
+/**
+ * Copy the characters of a short string to dest. Return the number copied.
+ */
+static inline int shortStringChars(Value value, char *dest) {
+  int length = shortStringLength(value);
+  for (int i = 0; i < length; i++) {
+    dest[i] = (char)(value.as.shortString >> (8 * i));
+  }
+  return length;
+}
+
 typedef struct {
   int capacity;
   int count;
@@ -49,8 +99,12 @@ typedef struct {
 bool valuesEqual(Value a, Value b);
 
 void initValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
-void freeValueArray(ValueArray *array);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
+/**
+ * Grow array so it has room for at least count values.
+ */
+void reserveValueArray(VM *vm, ValueArray *array, int count);
+void freeValueArray(VM *vm, ValueArray *array);
 void printValue(Value value);
 
 #endif
\ No newline at end of file
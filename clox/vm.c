@@ -4,14 +4,17 @@
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void resetStack(VM *vm) {
@@ -19,32 +22,90 @@ static void resetStack(VM *vm) {
   vm->frameCount = 0;
 }
 
-static void runtimeError(VM *vm, const char *format, ...) {
-  va_list args;
-  va_start(args, format);
+static void reportError(VM *vm, const char *format, va_list args) {
   vfprintf(stderr, format, args);
-  va_end(args);
   fputs("\n", stderr);
 
   CallFrame *frame = &vm->frames[vm->frameCount - 1];
   size_t instruction = frame->ip - frame->function->chunk.code - 1;
-  int line = frame->function->chunk.lines[instruction];
+  int line = getLine(&frame->function->chunk, (int)instruction);
   fprintf(stderr, "[line %d] in script\n", line);
 
   resetStack(vm);
 }
 
-void initVM(VM *vm) {
+static void runtimeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
+}
+
+_Noreturn void throwRuntimeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(vm, format, args);
+  va_end(args);
+
+  longjmp(*vm->errorHandler, 1);
+}
+
+void initVM(VM *vm, bool sharedStrings) {
   resetStack(vm);
   vm->objects = NULL;
-  initTable(&vm->strings);
+  vm->compiler = NULL;
+
+  vm->bytesAllocated = 0;
+  vm->peakBytes = 0;
+  vm->allocationCount = 0;
+  vm->freeCount = 0;
+  vm->nextGC = GC_INITIAL_THRESHOLD;
+  vm->heapGrowFactor = GC_HEAP_GROW_FACTOR;
+  vm->heapLimit = 0;
+
+  vm->gcPhase = GC_IDLE;
+  vm->gcDebt = 0;
+  vm->gcStepBudget = GC_STEP_BUDGET;
+  vm->gcThreads = 1;
+  vm->sweepList = NULL;
+
+  memset(vm->gcPauses, 0, sizeof(vm->gcPauses));
+  vm->gcPauseCount = 0;
+  vm->gcPauseMax = 0;
+
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+
+  memset(vm->poolFree, 0, sizeof(vm->poolFree));
+  vm->poolSlabs = NULL;
+
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->rememberedSet = NULL;
+  vm->errorHandler = NULL;
+
+  // Outside of the accounted heap, like the gray stack.
+  vm->nursery = (uint8_t *)malloc(NURSERY_SIZE);
+  if (vm->nursery == NULL) {
+    fprintf(stderr, "malloc failed.\n");
+    exit(1);
+  }
+  vm->nurseryTop = vm->nursery;
+  vm->promoted = NULL;
+
+  initStringSet(&vm->strings);
+  vm->sharedStrings = sharedStrings;
   initTable(&vm->globals);
+
+  defineNatives(vm);
 }
 
 void freeVM(VM *vm) {
-  freeTable(&vm->strings);
-  freeTable(&vm->globals);
+  freeStringSet(vm, &vm->strings);
+  freeTable(vm, &vm->globals);
   freeObjects(vm);
+  free(vm->nursery);
 }
 
 void push(VM *vm, Value value) {
@@ -63,20 +124,250 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool multiplyInts(int32_t a, int32_t b, int32_t *result) {
+  if (__builtin_mul_overflow(a, b, result)) {
+    return true;
+  }
+
+  // 0 * -1 is -0 as a double, which an int can't hold.
+  return *result == 0 && (a < 0 || b < 0);
+}
+
+static bool isStringLike(Value value) {
+  return IS_SHORT_STRING(value) || IS_STRING(value) || IS_ROPE(value);
+}
+
+static int valueLength(Value string) {
+  return IS_SHORT_STRING(string) ? shortStringLength(string)
+                                 : stringLength(AS_OBJ(string));
+}
+
+/**
+ * Copy the characters of a short or flat string to dest.
+ */
+static char *copyChars(char *dest, Value string) {
+  if (IS_SHORT_STRING(string)) {
+    return dest + shortStringChars(string, dest);
+  }
+
+  ObjString *flat = AS_STRING(string);
+  memcpy(dest, flat->chars, flat->length);
+  return dest + flat->length;
+}
+
+/**
+ * Replace a short string on the stack with an ObjString holding the same
+ * characters, for the rare places that need an object.
+ */
+static void materializeOnStack(VM *vm, int distance) {
+  Value value = peek(vm, distance);
+  if (IS_SHORT_STRING(value)) {
+    // Interned, so appending the same short string over and over shares one
+    // object.
+    char chars[SHORT_STRING_MAX];
+    int length = shortStringChars(value, chars);
+    vm->stackTop[-1 - distance] = OBJ_VAL(copyString(vm, chars, length));
+  }
+}
+
+/**
+ * Replace a rope on the stack with its flattened string, so the characters
+ * can be read directly.
+ */
+static void flattenOnStack(VM *vm, int distance) {
+  Value value = peek(vm, distance);
+  if (IS_ROPE(value)) {
+    vm->stackTop[-1 - distance] = OBJ_VAL(flattenRope(vm, AS_ROPE(value)));
+  }
+}
+
 static void concatenate(VM *vm) {
-  ObjString *b = AS_STRING(pop(vm));
-  ObjString *a = AS_STRING(pop(vm));
+  int leftLength = valueLength(peek(vm, 1));
+  int rightLength = valueLength(peek(vm, 0));
+  // Ropes make strings this long cheap enough to reach under a heap limit.
+  if (leftLength > INT_MAX - rightLength) {
+    throwRuntimeError(vm, "String too long.");
+  }
+  int length = leftLength + rightLength;
+
+  if (length <= SHORT_STRING_MAX) {
+    // So both operands are short too.
+    char chars[SHORT_STRING_MAX];
+    copyChars(copyChars(chars, peek(vm, 1)), peek(vm, 0));
+    pop(vm);
+    pop(vm);
+    push(vm, shortStringVal(chars, length));
+    return;
+  }
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  // Leave the operands on the stack until the result has been allocated so
+  // the collector can see them.
+
+  // Defer copying longer results so that building a string by appending to
+  // it in a loop doesn't copy everything built so far on each iteration.
+  if (length >= ROPE_MIN_LENGTH) {
+    materializeOnStack(vm, 0);
+    materializeOnStack(vm, 1);
+    ObjRope *rope = newRope(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(rope));
+    return;
+  }
+
+  ObjString *result = newStringBuffer(vm, length);
+
+  // Ropes are never shorter than ROPE_MIN_LENGTH, so both are flat here.
+  // The allocation may have moved them, so they're read again.
+  Value right = pop(vm);
+  Value left = pop(vm);
+  copyChars(copyChars(result->chars, left), right);
 
-  ObjString *result = takeString(vm, chars, length);
   push(vm, OBJ_VAL(result));
 }
 
+static bool callValue(VM *vm, Value callee, int argCount) {
+  if (!IS_NATIVE(callee)) {
+    runtimeError(vm, "Can only call native functions.");
+    return false;
+  }
+
+  ObjNative *native = AS_NATIVE(callee);
+  if (argCount != native->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity,
+                 argCount);
+    return false;
+  }
+
+  Value result = native->function(vm, argCount, vm->stackTop - argCount);
+  vm->stackTop -= argCount + 1;
+  push(vm, result);
+  return true;
+}
+
+/**
+ * Check that index can be used with a list or float array of count elements,
+ * and return it.
+ */
+static int checkIndex(VM *vm, Value index, int count) {
+  if (!IS_NUMBER(index)) {
+    throwRuntimeError(vm, "Index must be a number.");
+  }
+  // Written so that NaN is out of range too.
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < count)) {
+    throwRuntimeError(vm, "Index out of range.");
+  }
+  // Indexes computed with doubles, like len(list) / 2, are fine as long as
+  // they are whole.
+  if (number != (int)number) {
+    throwRuntimeError(vm, "Index must be an integer.");
+  }
+  return (int)number;
+}
+
+/**
+ * Return the value of the map, list or float array one slot down the stack
+ * at the index on top of it, for whatever the fast paths in run() don't
+ * handle.
+ */
+static Value getIndex(VM *vm) {
+  if (IS_MAP(peek(vm, 1))) {
+    uint32_t hash = prepareMapKey(vm, &vm->stackTop[-1]);
+    MapTable *table = &AS_MAP(peek(vm, 1))->table;
+    int position = mapTableFind(table, peek(vm, 0), hash);
+    // Missing keys read as nil, like undefined fields in other languages.
+    return position == -1 ? NIL_VAL : table->entries[position].value;
+  }
+
+  if (IS_LIST(peek(vm, 1))) {
+    ValueArray *items = &AS_LIST(peek(vm, 1))->items;
+    return items->values[checkIndex(vm, peek(vm, 0), items->count)];
+  }
+  if (IS_FLOAT_ARRAY(peek(vm, 1))) {
+    ObjFloatArray *array = AS_FLOAT_ARRAY(peek(vm, 1));
+    int index = checkIndex(vm, peek(vm, 0), array->count);
+    return NUMBER_VAL(array->values[index]);
+  }
+  throwRuntimeError(vm, "Only lists, maps and arrays can be indexed.");
+}
+
+/**
+ * Store the value on top of the stack at the index below it in the map, list
+ * or float array below that. Returns the position of a map entry, or -1
+ * otherwise.
+ */
+static int setIndex(VM *vm) {
+  if (IS_LIST(peek(vm, 2))) {
+    ObjList *list = AS_LIST(peek(vm, 2));
+    int index = checkIndex(vm, peek(vm, 1), list->items.count);
+    list->items.values[index] = peek(vm, 0);
+    writeBarrier(vm, (Obj *)list, peek(vm, 0));
+    return -1;
+  }
+  if (IS_FLOAT_ARRAY(peek(vm, 2))) {
+    ObjFloatArray *array = AS_FLOAT_ARRAY(peek(vm, 2));
+    int index = checkIndex(vm, peek(vm, 1), array->count);
+    if (!IS_NUMBER(peek(vm, 0))) {
+      throwRuntimeError(vm, "Array elements must be numbers.");
+    }
+    // Holds no references, so there's nothing for the collector to know.
+    array->values[index] = AS_NUMBER(peek(vm, 0));
+    return -1;
+  }
+  if (!IS_MAP(peek(vm, 2))) {
+    throwRuntimeError(vm, "Only lists, maps and arrays can be indexed.");
+  }
+
+  ObjMap *map = AS_MAP(peek(vm, 2));
+  uint32_t hash = prepareMapKey(vm, &vm->stackTop[-2]);
+  int position = mapTableFind(&map->table, peek(vm, 1), hash);
+
+  if (position == -1) {
+    // Intern new string keys, so constant keys find them by identity.
+    if (IS_STRING(peek(vm, 1))) {
+      vm->stackTop[-2] = OBJ_VAL(internString(vm, AS_STRING(peek(vm, 1))));
+    }
+    mapTableReserve(vm, &map->table);
+    // Allocating may have moved the key and value, so read them only now.
+    position = mapTableSet(&map->table, peek(vm, 1), hash, peek(vm, 0));
+    writeBarrier(vm, (Obj *)map, peek(vm, 1));
+  } else {
+    map->table.entries[position].value = peek(vm, 0);
+  }
+
+  writeBarrier(vm, (Obj *)map, peek(vm, 0));
+  return position;
+}
+
+static uint16_t readKeyCache(uint8_t *cache) {
+  return (uint16_t)((cache[0] << 8) | cache[1]);
+}
+
+static void writeKeyCache(uint8_t *cache, int position) {
+  if (position >= 0 && position < KEY_CACHE_EMPTY) {
+    cache[0] = (position >> 8) & 0xff;
+    cache[1] = position & 0xff;
+  }
+}
+
+/**
+ * Whether the key of a map entry is the constant string key. Both are
+ * interned, so this is a comparison of bits rather than characters.
+ */
+static bool isCachedKey(MapTable *table, int position, Value key) {
+  if (position >= table->entryCount) {
+    return false;
+  }
+
+  Value entryKey = table->entries[position].key;
+  if (IS_SHORT_STRING(key)) {
+    return IS_SHORT_STRING(entryKey) &&
+           entryKey.as.shortString == key.as.shortString;
+  }
+  return IS_OBJ(entryKey) && AS_OBJ(entryKey) == AS_OBJ(key);
+}
+
 static InterpretResult run(VM *vm) {
   CallFrame *frame = &vm->frames[vm->frameCount - 1];
 #define READ_BYTE() (*frame->ip++)
@@ -85,6 +376,13 @@ static InterpretResult run(VM *vm) {
 #define READ_SHORT()                                                           \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+// 24 bit big-endian operand of the *_LONG instructions
+#define READ_LONG()                                                            \
+  (frame->ip += 3,                                                             \
+   (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT_LONG()                                                   \
+  (frame->function->chunk.constants.values[READ_LONG()])
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
     if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                  \
@@ -95,7 +393,31 @@ static InterpretResult run(VM *vm) {
     double a = AS_NUMBER(pop(vm));                                             \
     push(vm, valueType(a op b));                                               \
   } while (false)
-
+#define COMPARISON_OP(op)                                                      \
+  do {                                                                         \
+    if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) {                          \
+      int32_t b = AS_INT(pop(vm));                                             \
+      int32_t a = AS_INT(pop(vm));                                             \
+      push(vm, BOOL_VAL(a op b));                                              \
+      break;                                                                   \
+    }                                                                          \
+    BINARY_OP(BOOL_VAL, op);                                                   \
+  } while (false)
+// Two ints are combined with intOp, which returns true when the result can't
+// be represented as an int. Then we fall back to doing it with doubles.
+#define ARITHMETIC_OP(intOp, op)                                               \
+  do {                                                                         \
+    if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) {                          \
+      int32_t result;                                                          \
+      if (!intOp(AS_INT(peek(vm, 1)), AS_INT(peek(vm, 0)), &result)) {         \
+        pop(vm);                                                               \
+        pop(vm);                                                               \
+        push(vm, INT_VAL(result));                                             \
+        break;                                                                 \
+      }                                                                        \
+    }                                                                          \
+    BINARY_OP(NUMBER_VAL, op);                                                 \
+  } while (false)
   while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
     // Print out the stack from bottom to top.
@@ -119,6 +441,11 @@ static InterpretResult run(VM *vm) {
       push(vm, constant);
       break;
     }
+    case OP_CONSTANT_LONG: {
+      Value constant = READ_CONSTANT_LONG();
+      push(vm, constant);
+      break;
+    }
     case OP_NIL:
       push(vm, NIL_VAL);
       break;
@@ -133,15 +460,21 @@ static InterpretResult run(VM *vm) {
       pop(vm);
       break;
 
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm->globals, name, peek(vm, 0));
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG: {
+      ObjString *name =
+          instruction == OP_DEFINE_GLOBAL ? READ_STRING() : READ_STRING_LONG();
+      tableSet(vm, &vm->globals, name, peek(vm, 0));
+      // The collector only scans the globals when a cycle starts.
+      shadeValue(vm, peek(vm, 0));
       pop(vm);
       break;
     }
 
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      ObjString *name =
+          instruction == OP_GET_GLOBAL ? READ_STRING() : READ_STRING_LONG();
       Value value;
 
       if (!tableGet(&vm->globals, name, &value)) {
@@ -153,13 +486,16 @@ static InterpretResult run(VM *vm) {
       break;
     }
 
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm->globals, name, peek(vm, 0))) {
-        tableDelete(&vm->globals, name);
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      ObjString *name =
+          instruction == OP_SET_GLOBAL ? READ_STRING() : READ_STRING_LONG();
+      if (tableSet(vm, &vm->globals, name, peek(vm, 0))) {
+        tableDelete(vm, &vm->globals, name);
         runtimeError(vm, "Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
+      shadeValue(vm, peek(vm, 0));
       break;
     }
 
@@ -171,11 +507,15 @@ static InterpretResult run(VM *vm) {
 
     case OP_SET_LOCAL: {
       uint8_t slot = READ_BYTE();
+      // No barrier needed: the stack is scanned again before marking ends.
       frame->slots[slot] = peek(vm, 0);
       break;
     }
 
     case OP_EQUAL: {
+      // Ropes are compared by their characters, which need flattening first.
+      flattenOnStack(vm, 0);
+      flattenOnStack(vm, 1);
       Value b = pop(vm);
       Value a = pop(vm);
       push(vm, BOOL_VAL(valuesEqual(a, b)));
@@ -183,30 +523,29 @@ static InterpretResult run(VM *vm) {
     }
 
     case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
+      COMPARISON_OP(>);
       break;
     case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
+      COMPARISON_OP(<);
       break;
 
     case OP_ADD: {
-      if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+      if (isStringLike(peek(vm, 0)) && isStringLike(peek(vm, 1))) {
         concatenate(vm);
       } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-        double b = AS_NUMBER(pop(vm));
-        double a = AS_NUMBER(pop(vm));
-        push(vm, NUMBER_VAL(a + b));
+        ARITHMETIC_OP(__builtin_add_overflow, +);
       } else {
         runtimeError(vm, "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
       }
       break;
     }
 
     case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
+      ARITHMETIC_OP(__builtin_sub_overflow, -);
       break;
     case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
+      ARITHMETIC_OP(multiplyInts, *);
       break;
     case OP_DIVIDE:
       BINARY_OP(NUMBER_VAL, /);
@@ -221,11 +560,17 @@ static InterpretResult run(VM *vm) {
         return INTERPRET_RUNTIME_ERROR;
       }
 
-      // Negate the top value on the stack
+      // Negate the top value on the stack. -0 and -INT32_MIN aren't ints.
+      if (IS_INT(peek(vm, 0)) && AS_INT(peek(vm, 0)) != 0 &&
+          AS_INT(peek(vm, 0)) != INT32_MIN) {
+        push(vm, INT_VAL(-AS_INT(pop(vm))));
+        break;
+      }
       push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
       break;
 
     case OP_PRINT:
+      flattenOnStack(vm, 0);
       printValue(pop(vm));
       printf("\n");
       break;
@@ -250,6 +595,142 @@ static InterpretResult run(VM *vm) {
       break;
     }
 
+    case OP_CALL: {
+      int argCount = READ_BYTE();
+      if (!callValue(vm, peek(vm, argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+
+    case OP_BUILD_LIST: {
+      int count = READ_BYTE();
+      ObjList *list = newList(vm);
+      push(vm, OBJ_VAL(list));
+      reserveValueArray(vm, &list->items, count);
+
+      // Read the elements only now, since allocating may have moved them.
+      Value *elements = vm->stackTop - 1 - count;
+      for (int i = 0; i < count; i++) {
+        list->items.values[i] = elements[i];
+        writeBarrier(vm, (Obj *)list, elements[i]);
+      }
+      list->items.count = count;
+
+      vm->stackTop = elements;
+      push(vm, OBJ_VAL(list));
+      break;
+    }
+
+    case OP_GET_INDEX: {
+      // Most list indexes are ints within bounds, which one unsigned
+      // comparison checks.
+      Value index = peek(vm, 0);
+      Value value;
+      if (IS_LIST(peek(vm, 1)) && IS_INT(index) &&
+          (uint32_t)AS_INT(index) <
+              (uint32_t)AS_LIST(peek(vm, 1))->items.count) {
+        value = AS_LIST(peek(vm, 1))->items.values[AS_INT(index)];
+      } else {
+        value = getIndex(vm);
+      }
+      vm->stackTop -= 2;
+      push(vm, value);
+      break;
+    }
+
+    case OP_SET_INDEX: {
+      Value index = peek(vm, 1);
+      if (IS_LIST(peek(vm, 2)) && IS_INT(index) &&
+          (uint32_t)AS_INT(index) <
+              (uint32_t)AS_LIST(peek(vm, 2))->items.count) {
+        ObjList *list = AS_LIST(peek(vm, 2));
+        list->items.values[AS_INT(index)] = peek(vm, 0);
+        writeBarrier(vm, (Obj *)list, peek(vm, 0));
+      } else {
+        setIndex(vm);
+      }
+      // The assignment evaluates to the value.
+      Value value = pop(vm);
+      vm->stackTop -= 2;
+      push(vm, value);
+      break;
+    }
+
+    case OP_BUILD_MAP: {
+      int count = READ_BYTE();
+      push(vm, OBJ_VAL(newMap(vm)));
+
+      // setIndex() wants the map, a key and its value on top of the stack.
+      for (int i = 0; i < count; i++) {
+        push(vm, peek(vm, 0));
+        push(vm, peek(vm, 2 * (count - i) + 1));
+        push(vm, peek(vm, 2 * (count - i) + 1));
+        setIndex(vm);
+        vm->stackTop -= 3;
+      }
+
+      Value map = pop(vm);
+      vm->stackTop -= 2 * count;
+      push(vm, map);
+      break;
+    }
+
+    case OP_GET_KEY: {
+      Value key = READ_CONSTANT();
+      uint8_t *cache = frame->ip;
+      frame->ip += 2;
+
+      if (!IS_MAP(peek(vm, 0))) {
+        push(vm, key);
+        Value value = getIndex(vm);
+        vm->stackTop -= 2;
+        push(vm, value);
+        break;
+      }
+
+      MapTable *table = &AS_MAP(peek(vm, 0))->table;
+      int position = readKeyCache(cache);
+      if (!isCachedKey(table, position, key)) {
+        // Prepare the key first, since it may be rewritten in place.
+        uint32_t hash = prepareMapKey(vm, &key);
+        position = mapTableFind(table, key, hash);
+        writeKeyCache(cache, position);
+      }
+      vm->stackTop[-1] =
+          position == -1 ? NIL_VAL : table->entries[position].value;
+      break;
+    }
+
+    case OP_SET_KEY: {
+      Value key = READ_CONSTANT();
+      uint8_t *cache = frame->ip;
+      frame->ip += 2;
+
+      if (IS_MAP(peek(vm, 1))) {
+        ObjMap *map = AS_MAP(peek(vm, 1));
+        int position = readKeyCache(cache);
+        if (isCachedKey(&map->table, position, key)) {
+          map->table.entries[position].value = peek(vm, 0);
+          writeBarrier(vm, (Obj *)map, peek(vm, 0));
+          Value value = pop(vm);
+          vm->stackTop[-1] = value;
+          break;
+        }
+      }
+
+      // Put the key under the value, where OP_SET_INDEX has it.
+      Value value = pop(vm);
+      push(vm, key);
+      push(vm, value);
+      writeKeyCache(cache, setIndex(vm));
+
+      value = pop(vm);
+      vm->stackTop -= 2;
+      push(vm, value);
+      break;
+    }
+
     case OP_RETURN: {
       return INTERPRET_OK;
     }
@@ -259,7 +740,12 @@ static InterpretResult run(VM *vm) {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
 #undef BINARY_OP
+#undef COMPARISON_OP
+#undef ARITHMETIC_OP
 }
 
 InterpretResult interpret(VM *vm, const char *source) {
@@ -274,5 +760,14 @@ InterpretResult interpret(VM *vm, const char *source) {
   frame->ip = function->chunk.code;
   frame->slots = vm->stack;
 
-  return run(vm);
+  jmp_buf handler;
+  if (setjmp(handler) != 0) {
+    vm->errorHandler = NULL;
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm->errorHandler = &handler;
+
+  InterpretResult result = run(vm);
+  vm->errorHandler = NULL;
+  return result;
 }
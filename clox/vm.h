@@ -7,11 +7,28 @@
 #include "table.h"
 #include "value.h"
 
+#include <setjmp.h>
 #include <stdint.h>
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+struct Compiler;
+
+// Where the incremental collector is in its current cycle.
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP } GCPhase;
+
+// Pause times are counted in power-of-two buckets of microseconds: bucket i
+// holds pauses shorter than 2^i us, and the last one everything longer.
+#define GC_PAUSE_BUCKETS 24
+
+// Blocks of up to POOL_MAX_SIZE bytes are carved out of POOL_SLAB_SIZE slabs
+// and kept on free lists, one for each multiple of POOL_GRANULE bytes.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (16 * 1024)
+
 // A representation of a single ongoing function call.
 typedef struct {
   ObjFunction *function;
@@ -32,9 +49,69 @@ struct VM {
 
   Table globals;
 
-  Table strings;
+  // Interned strings. They are weak references: the collector removes
+  // strings nothing else refers to.
+  StringSet strings;
+  // Intern strings in the process-wide interner instead of this VM's heap,
+  // with vm->strings caching the ones this VM has seen. Strings can only be
+  // handed between VMs that both do this. Fixed by initVM().
+  bool sharedStrings;
 
   Obj *objects;
+
+  // The function being compiled, which the collector must not free even
+  // though nothing on the stack refers to it yet.
+  struct Compiler *compiler;
+
+  size_t bytesAllocated;
+  // The most bytesAllocated has been.
+  size_t peakBytes;
+  // Calls to reallocate that allocated a new block or freed one.
+  uint64_t allocationCount;
+  uint64_t freeCount;
+  // Collect garbage once bytesAllocated goes past this.
+  size_t nextGC;
+  // The most bytes a running script may have allocated, or 0 for no limit.
+  size_t heapLimit;
+  double heapGrowFactor;
+
+  GCPhase gcPhase;
+  // Bytes allocated since the last incremental step.
+  size_t gcDebt;
+  // The most objects a single step marks or sweeps.
+  int gcStepBudget;
+  // How many threads mark the heap. More than one makes marking parallel, but
+  // no longer incremental.
+  int gcThreads;
+  // Old objects still to be swept in this cycle.
+  Obj *sweepList;
+
+  uint64_t gcPauses[GC_PAUSE_BUCKETS];
+  uint64_t gcPauseCount;
+  // In nanoseconds.
+  uint64_t gcPauseMax;
+
+  // Objects that have been marked but whose references haven't been yet.
+  int grayCount;
+  int grayCapacity;
+  Obj **grayStack;
+
+  void *poolFree[POOL_CLASSES];
+  // Every slab, linked through its first word.
+  void *poolSlabs;
+
+  // The young generation. Objects are allocated at nurseryTop.
+  uint8_t *nursery;
+  uint8_t *nurseryTop;
+  // Objects promoted by the running minor collection but not yet scanned.
+  Obj *promoted;
+  // Old objects that may refer to young ones.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **rememberedSet;
+
+  // Where throwRuntimeError unwinds to while a script is running.
+  jmp_buf *errorHandler;
 };
 
 typedef enum {
@@ -43,11 +120,21 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-void initVM(VM *vm);
+/**
+ * sharedStrings sets vm->sharedStrings. It is passed in rather than set
+ * afterwards because initVM already interns the names of the natives.
+ */
+void initVM(VM *vm, bool sharedStrings);
 void freeVM(VM *vm);
 
 InterpretResult interpret(VM *vm, const char *source);
 void push(VM *vm, Value value);
 Value pop(VM *vm);
 
+/**
+ * Report a runtime error and unwind out of the running script, making
+ * interpret() return INTERPRET_RUNTIME_ERROR.
+ */
+_Noreturn void throwRuntimeError(VM *vm, const char *format, ...);
+
 #endif
\ No newline at end of file